@@ -0,0 +1,278 @@
+#include "AsyncReadback.h"
+
+#include <string.h>
+
+// Delivered image buffers kept for reuse
+static const size_t kSpareImages = 4u;
+
+void AsyncReadback::shutdown()
+{
+	// Copies already on their way still reach their images, pieces not started are dropped
+	for (Slot& slot : mSlots)
+	{
+		if (slot.fence)
+		{
+			glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			finish_copy(slot);
+		}
+		glDeleteBuffers(1, &slot.buffer);
+		slot.buffer = 0u;
+		slot.capacity = 0u;
+	}
+	// Callbacks of jobs without pieces still run, there is nothing left to wait for
+	for (size_t index = 0u; index < mJobs.size();)
+	{
+		if (mJobs[index]->pieces.empty())
+			complete(*mJobs[index]);
+		else
+			++index;
+	}
+	mJobs.clear();
+	stop_worker();
+}
+
+void AsyncReadback::request(int width, int height, std::vector<ReadbackPiece> pieces, const ReadbackFormat& format, ReadbackCallback callback)
+{
+	std::unique_ptr<Job> job(new Job);
+	job->image.width = width;
+	job->image.height = height;
+	job->pieces = std::move(pieces);
+	job->format = format;
+	job->callback = std::move(callback);
+	mJobs.push_back(std::move(job));
+	if (mJobs.size() == 1u && mJobs.back()->pieces.empty())
+		complete(*mJobs.back());
+}
+
+bool AsyncReadback::capture(GLuint framebuffer, int x, int y, int width, int height, const ReadbackFormat& format, ReadbackCallback callback)
+{
+	Slot* slot = free_slot();
+	if (!slot)
+		return false;
+
+	ReadbackPiece piece = { 0, 0, 0, x, y, width, height, 0, 0, 0 };
+	std::unique_ptr<Job> job(new Job);
+	job->image.width = width;
+	job->image.height = height;
+	job->pieces.push_back(piece);
+	job->next_piece = 1u;
+	job->format = format;
+	allocate_image(*job);
+	job->callback = std::move(callback);
+	start_copy(*slot, *job, piece, framebuffer);
+	mJobs.push_back(std::move(job));
+	return true;
+}
+
+void AsyncReadback::update(const Source& source)
+{
+	// Polling the fences never blocks, copies not done yet are looked at next frame
+	for (Slot& slot : mSlots)
+	{
+		if (!slot.fence)
+			continue;
+		GLenum status = glClientWaitSync(slot.fence, 0, 0u);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+			finish_copy(slot);
+	}
+
+	// Start pieces in request order while buffers are free
+	size_t index = 0u;
+	while (index < mJobs.size())
+	{
+		Job& job = *mJobs[index];
+		while (job.next_piece < job.pieces.size() && free_slot())
+		{
+			const ReadbackPiece& piece = job.pieces[job.next_piece];
+			GLuint framebuffer = 0u;
+			if (!source(piece, framebuffer))
+				break;
+			++job.next_piece;
+			allocate_image(job);
+			if (framebuffer)
+			{
+				start_copy(*free_slot(), job, piece, framebuffer);
+			}
+			else
+			{
+				fill_black(job, piece);
+				++job.pieces_done;
+			}
+		}
+
+		// Jobs without pieces wait for every one before them
+		if (job.pieces_done == job.pieces.size() && (index == 0u || !job.pieces.empty()))
+			complete(job);
+		else
+			++index;
+	}
+}
+
+bool AsyncReadback::can_capture() const
+{
+	for (const Slot& slot : mSlots)
+		if (!slot.fence)
+			return true;
+	return false;
+}
+
+AsyncReadback::Slot* AsyncReadback::free_slot()
+{
+	for (Slot& slot : mSlots)
+		if (!slot.fence)
+			return &slot;
+	return nullptr;
+}
+
+void AsyncReadback::start_copy(Slot& slot, Job& job, const ReadbackPiece& piece, GLuint framebuffer)
+{
+	size_t bytes = static_cast<size_t>(piece.width) * piece.height * job.format.pixel_bytes;
+	if (!slot.buffer)
+		glGenBuffers(1, &slot.buffer);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	if (slot.capacity < bytes)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+		slot.capacity = bytes;
+	}
+
+	// Returns immediately, the copy lands in the buffer when the GPU gets to it
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(piece.x, piece.y, piece.width, piece.height, job.format.format, job.format.type, (void*)0);
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.job = &job;
+	slot.piece = piece;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0u);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0u);
+}
+
+void AsyncReadback::finish_copy(Slot& slot)
+{
+	Job& job = *slot.job;
+	const ReadbackPiece& piece = slot.piece;
+	size_t pixel_bytes = job.format.pixel_bytes;
+	size_t row_bytes = static_cast<size_t>(piece.width) * pixel_bytes;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	const unsigned char* pixels = static_cast<const unsigned char*>(
+		glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, row_bytes * piece.height, GL_MAP_READ_BIT));
+	if (pixels)
+	{
+		for (int row = 0; row < piece.height; ++row)
+		{
+			size_t offset = (static_cast<size_t>(piece.dst_y + row) * job.image.width + piece.dst_x) * pixel_bytes;
+			memcpy(&job.image.pixels[offset], pixels + row * row_bytes, row_bytes);
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0u);
+	glDeleteSync(slot.fence);
+	slot.fence = nullptr;
+	slot.job = nullptr;
+
+	if (++job.pieces_done == job.pieces.size())
+		complete(job);
+}
+
+void AsyncReadback::allocate_image(Job& job)
+{
+	if (!job.image.pixels.empty())
+		return;
+	size_t bytes = static_cast<size_t>(job.image.width) * job.image.height * job.format.pixel_bytes;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (auto it = mSpare.begin(); it != mSpare.end(); ++it)
+		{
+			if (it->size() != bytes)
+				continue;
+			job.image.pixels.swap(*it);
+			mSpare.erase(it);
+			return;
+		}
+	}
+	job.image.pixels.resize(bytes);
+}
+
+void AsyncReadback::fill_black(Job& job, const ReadbackPiece& piece)
+{
+	// Same as a cleared tile, opaque black. Other layouts are zeroed
+	if (job.format.format != GL_RGBA || job.format.type != GL_UNSIGNED_BYTE)
+	{
+		size_t row_bytes = static_cast<size_t>(piece.width) * job.format.pixel_bytes;
+		for (int row = 0; row < piece.height; ++row)
+			memset(&job.image.pixels[(static_cast<size_t>(piece.dst_y + row) * job.image.width + piece.dst_x) * job.format.pixel_bytes], 0, row_bytes);
+		return;
+	}
+	for (int row = 0; row < piece.height; ++row)
+	{
+		unsigned char* pixel = &job.image.pixels[(static_cast<size_t>(piece.dst_y + row) * job.image.width + piece.dst_x) * 4u];
+		for (int column = 0; column < piece.width; ++column, pixel += 4)
+		{
+			pixel[0] = pixel[1] = pixel[2] = 0u;
+			pixel[3] = 255u;
+		}
+	}
+}
+
+void AsyncReadback::complete(Job& job)
+{
+	for (auto it = mJobs.begin(); it != mJobs.end(); ++it)
+	{
+		if (it->get() != &job)
+			continue;
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFinished.push_back(std::move(*it));
+		}
+		mJobs.erase(it);
+		break;
+	}
+	if (!mWorker.joinable())
+	{
+		mStop = false;
+		mWorker = std::thread(&AsyncReadback::deliver, this);
+	}
+	mFinishedReady.notify_one();
+}
+
+void AsyncReadback::deliver()
+{
+	for (;;)
+	{
+		std::unique_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mFinishedReady.wait(lock, [this]() { return mStop || !mFinished.empty(); });
+			if (mFinished.empty())
+				return;
+			job = std::move(mFinished.front());
+			mFinished.pop_front();
+		}
+
+		if (job->format.expand_red)
+		{
+			unsigned char* pixel = job->image.pixels.data();
+			for (size_t i = 0; i < job->image.pixels.size(); i += 4u)
+				pixel[i + 1] = pixel[i + 2] = pixel[i];
+		}
+		job->callback(job->image);
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mSpare.size() < kSpareImages)
+			mSpare.push_back(std::move(job->image.pixels));
+	}
+}
+
+void AsyncReadback::stop_worker()
+{
+	// Callbacks still queued run before the worker exits
+	if (!mWorker.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mFinishedReady.notify_one();
+	mWorker.join();
+}
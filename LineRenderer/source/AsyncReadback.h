@@ -0,0 +1,112 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pixels handed to readback callbacks in the requested layout, rows bottom up like GL
+struct ReadbackImage
+{
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> pixels;
+};
+typedef std::function<void(const ReadbackImage&)> ReadbackCallback;
+
+// Client side layout pieces are read in, RGBA8 unless asked otherwise
+struct ReadbackFormat
+{
+	GLenum format = GL_RGBA;
+	GLenum type = GL_UNSIGNED_BYTE;
+	size_t pixel_bytes = 4u;
+	bool expand_red = false;	// Single channel source read as RGBA8, red is copied to green and blue
+};
+
+// Rectangle of one source framebuffer landing at (dst_x, dst_y) in the image. Level
+// and tile say which framebuffer, the renderer resolves them when the copy starts and
+// may use the tag to tell its own kinds of requests apart
+struct ReadbackPiece
+{
+	int level, tile_x, tile_y;
+	int x, y, width, height;
+	int dst_x, dst_y;
+	int tag;
+};
+
+// GPU to CPU copies that never wait on the GPU. glReadPixels goes into one of a ring of
+// pixel buffer objects and a fence, the buffer is mapped a frame or more later once the
+// fence has signaled. Finished images go to a worker thread that runs the callbacks, and
+// their memory is kept for later images of the same size so repeated captures don't
+// allocate and clear it on the render thread every time
+class AsyncReadback
+{
+public:
+	static const int kSlotCount = 8;
+
+	// Framebuffer holding a piece, false while it can't be read yet. 0 reads as black
+	typedef std::function<bool(const ReadbackPiece&, GLuint& framebuffer)> Source;
+
+	~AsyncReadback() { stop_worker(); }
+	// Needs the GL context, waits for copies still in flight and callbacks still queued
+	void shutdown();
+
+	// Image assembled from pieces copied as buffers free up. Its memory is only allocated
+	// once the first piece starts, so requests can be queued well ahead. Without pieces
+	// the callback runs on the worker once every request before it has been delivered
+	void request(int width, int height, std::vector<ReadbackPiece> pieces, const ReadbackFormat& format, ReadbackCallback callback);
+	// Starts copying a framebuffer right away, false when every buffer is in use
+	bool capture(GLuint framebuffer, int x, int y, int width, int height, const ReadbackFormat& format, ReadbackCallback callback);
+
+	// Maps the buffers whose copy finished and starts pending ones. Called once per frame
+	void update(const Source& source);
+	bool is_busy() const { return !mJobs.empty(); }
+	// A capture started now would find a buffer
+	bool can_capture() const;
+
+private:
+	struct Job
+	{
+		ReadbackImage image;
+		std::vector<ReadbackPiece> pieces;
+		size_t next_piece = 0u;
+		size_t pieces_done = 0u;
+		ReadbackFormat format;
+		ReadbackCallback callback;
+	};
+
+	struct Slot
+	{
+		GLuint buffer = 0u;
+		size_t capacity = 0u;
+		GLsync fence = nullptr;
+		Job* job = nullptr;
+		ReadbackPiece piece;
+	};
+
+	Slot* free_slot();
+	void start_copy(Slot& slot, Job& job, const ReadbackPiece& piece, GLuint framebuffer);
+	void finish_copy(Slot& slot);
+	void allocate_image(Job& job);
+	static void fill_black(Job& job, const ReadbackPiece& piece);
+	void complete(Job& job);
+	void deliver();
+	void stop_worker();
+
+	Slot mSlots[kSlotCount];
+	std::deque<std::unique_ptr<Job>> mJobs;	// In request order, captures included
+
+	// Finished jobs waiting for their callback
+	std::thread mWorker;
+	std::mutex mMutex;
+	std::condition_variable mFinishedReady;
+	std::deque<std::unique_ptr<Job>> mFinished;
+	std::vector<std::vector<unsigned char>> mSpare;	// Pixels of delivered images, reused by size
+	bool mStop = false;
+};
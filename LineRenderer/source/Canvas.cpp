@@ -0,0 +1,366 @@
+#include "Canvas.h"
+#include "TileCodec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	struct FormatInfo
+	{
+		const char* name;
+		GLenum internal_format;
+		GLenum format;	// Client side layout for readback and upload, as stored
+		GLenum type;
+		size_t pixel_bytes;
+	};
+
+	// Same order as CanvasFormat
+	const FormatInfo kFormats[] =
+	{
+		{ "rgba8", GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4u },
+		{ "rgb10a2", GL_RGB10_A2, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, 4u },
+		{ "rgba16f", GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, 8u },
+		{ "r8", GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1u }
+	};
+}
+
+Tile* Canvas::find_tile(int level, int x, int y)
+{
+	auto it = mTiles.find(tile_key(level, x, y));
+	if (it == mTiles.end())
+		return nullptr;
+
+	Tile& tile = it->second;
+	tile.last_used = mFrame;
+	if (!tile.compressed.empty())
+		restore_tile(tile);
+	return &tile;
+}
+
+Tile& Canvas::acquire_tile(int level, int x, int y)
+{
+	Tile& tile = mTiles[tile_key(level, x, y)];
+	tile.last_used = mFrame;
+	if (!tile.compressed.empty())
+		restore_tile(tile);
+	if (tile.framebuffer)
+		return tile;
+
+	if (!allocate_tile(tile))
+		fprintf(stdout, "Tile framebuffer (%d, %d, %d) failed to complete.\n", level, x, y);
+	++mAllocatedTiles;
+
+	// Empty canvas is black
+	glViewport(0, 0, kTileSize, kTileSize);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	return tile;
+}
+
+void Canvas::release_tile(int level, int x, int y)
+{
+	auto it = mTiles.find(tile_key(level, x, y));
+	if (it == mTiles.end())
+		return;
+
+	if (it->second.framebuffer)
+	{
+		free_tile(it->second);
+		--mAllocatedTiles;
+	}
+	if (!it->second.compressed.empty())
+	{
+		--mCompressedTiles;
+		mCompressedBytes -= it->second.compressed.size();
+	}
+	mTiles.erase(it);
+}
+
+bool Canvas::drawn_bounds(int& min_x, int& min_y, int& max_x, int& max_y) const
+{
+	bool any = false;
+	for (const auto& it : mTiles)
+	{
+		if (key_level(it.first) != 0 || (!it.second.framebuffer && it.second.compressed.empty()))
+			continue;
+		int x = key_x(it.first), y = key_y(it.first);
+		min_x = !any || x < min_x ? x : min_x;
+		min_y = !any || y < min_y ? y : min_y;
+		max_x = !any || x > max_x ? x : max_x;
+		max_y = !any || y > max_y ? y : max_y;
+		any = true;
+	}
+	return any;
+}
+
+void Canvas::load_tile(int x, int y, const unsigned char* data, size_t size, bool compressed)
+{
+	if (!compressed)
+	{
+		Tile& tile = acquire_tile(0, x, y);
+		glBindTexture(GL_TEXTURE_2D, tile.texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTileSize, kTileSize, client_format(), client_type(), data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		return;
+	}
+
+	// Same state update_residency leaves a cold tile in
+	release_tile(0, x, y);
+	Tile& tile = mTiles[tile_key(0, x, y)];
+	tile.compressed.assign(data, data + size);
+	tile.last_used = mFrame;
+	++mCompressedTiles;
+	mCompressedBytes += size;
+}
+
+void Canvas::stored_tiles(std::vector<StoredTile>& tiles) const
+{
+	tiles.clear();
+	for (const auto& it : mTiles)
+	{
+		if (key_level(it.first) != 0 || (!it.second.framebuffer && it.second.compressed.empty()))
+			continue;
+		StoredTile tile = { key_x(it.first), key_y(it.first), it.second.framebuffer ? nullptr : &it.second.compressed };
+		tiles.push_back(tile);
+	}
+}
+
+bool Canvas::stored_tile(int x, int y, StoredTile& tile) const
+{
+	auto it = mTiles.find(tile_key(0, x, y));
+	if (it == mTiles.end() || (!it->second.framebuffer && it->second.compressed.empty()))
+		return false;
+	tile.x = x;
+	tile.y = y;
+	tile.compressed = it->second.framebuffer ? nullptr : &it->second.compressed;
+	return true;
+}
+
+void Canvas::release()
+{
+	for (Eviction& eviction : mEvictions)
+	{
+		if (eviction.fence)
+			glDeleteSync(eviction.fence);
+		glDeleteBuffers(1, &eviction.buffer);
+		eviction = Eviction();
+	}
+	for (auto& it : mTiles)
+		free_tile(it.second);
+	mTiles.clear();
+	mAllocatedTiles = 0u;
+	mCompressedTiles = 0u;
+	mCompressedBytes = 0u;
+}
+
+void Canvas::exchange_tile(int level, int x, int y, Tile& other)
+{
+	find_tile(level, x, y);
+	Tile& tile = mTiles[tile_key(level, x, y)];
+	bool had_storage = tile.framebuffer != 0u;
+	GLuint framebuffer = tile.framebuffer, texture = tile.texture;
+	tile.framebuffer = other.framebuffer;
+	tile.texture = other.texture;
+	other.framebuffer = framebuffer;
+	other.texture = texture;
+	other.dirty = false;
+
+	if (had_storage)
+		--mAllocatedTiles;
+	if (tile.framebuffer)
+		++mAllocatedTiles;
+	else
+		mTiles.erase(tile_key(level, x, y));
+}
+
+void Canvas::update_residency()
+{
+	++mFrame;
+
+	// Fences are only polled, a copy not done yet is looked at next frame
+	for (Eviction& eviction : mEvictions)
+	{
+		if (!eviction.fence)
+			continue;
+		GLenum status = glClientWaitSync(eviction.fence, 0, 0u);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+			finish_eviction(eviction);
+	}
+
+	// Free buffers take the next cold tiles
+	int slot = 0;
+	for (auto& it : mTiles)
+	{
+		while (slot < kCompressPerFrame && mEvictions[slot].fence)
+			++slot;
+		if (slot == kCompressPerFrame)
+			return;
+
+		// Detail tiles have their own eviction, dirty ones are about to change anyway
+		Tile& tile = it.second;
+		if (!tile.framebuffer || tile.dirty || key_level(it.first) < 0 || mFrame - tile.last_used < kColdFrames)
+			continue;
+		bool queued = false;
+		for (const Eviction& eviction : mEvictions)
+			queued = queued || (eviction.fence && eviction.key == it.first);
+		if (queued)
+			continue;
+
+		Eviction& eviction = mEvictions[slot];
+		const FormatInfo& info = kFormats[static_cast<int>(mFormat)];
+		if (!eviction.buffer)
+		{
+			glGenBuffers(1, &eviction.buffer);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, eviction.buffer);
+			glBufferData(GL_PIXEL_PACK_BUFFER, tile_bytes(), nullptr, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, eviction.buffer);
+		glBindTexture(GL_TEXTURE_2D, tile.texture);
+		glGetTexImage(GL_TEXTURE_2D, 0, info.format, info.type, (void*)0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0u);
+		eviction.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		eviction.key = it.first;
+		eviction.last_used = tile.last_used;
+	}
+}
+
+void Canvas::finish_eviction(Eviction& eviction)
+{
+	glDeleteSync(eviction.fence);
+	eviction.fence = nullptr;
+
+	// Tiles are only changed through an access, so one left alone still holds what was copied
+	auto it = mTiles.find(eviction.key);
+	if (it == mTiles.end() || !it->second.framebuffer || it->second.dirty || it->second.last_used != eviction.last_used)
+		return;
+
+	Tile& tile = it->second;
+	mPixels.resize(tile_bytes());
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, eviction.buffer);
+	const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, mPixels.size(), GL_MAP_READ_BIT);
+	if (pixels)
+	{
+		memcpy(mPixels.data(), pixels, mPixels.size());
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0u);
+	if (!pixels)
+		return;
+
+	TileCodec::compress(mPixels.data(), mPixels.size(), tile.compressed);
+	tile.compressed.shrink_to_fit();
+	free_tile(tile);
+	--mAllocatedTiles;
+	++mCompressedTiles;
+	mCompressedBytes += tile.compressed.size();
+}
+
+void Canvas::restore_tile(Tile& tile)
+{
+	const FormatInfo& info = kFormats[static_cast<int>(mFormat)];
+	mPixels.resize(tile_bytes());
+	if (!TileCodec::decompress(tile.compressed.data(), tile.compressed.size(), mPixels.data(), mPixels.size()))
+		fprintf(stdout, "Compressed tile failed to decode.\n");
+
+	if (!allocate_tile(tile))
+		fprintf(stdout, "Restored tile framebuffer failed to complete.\n");
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTileSize, kTileSize, info.format, info.type, mPixels.data());
+	++mAllocatedTiles;
+	--mCompressedTiles;
+	mCompressedBytes -= tile.compressed.size();
+	std::vector<unsigned char>().swap(tile.compressed);
+}
+
+bool Canvas::allocate_tile(Tile& tile) const
+{
+	// Clamp so filtering never pulls in texels from the opposite edge
+	glGenTextures(1, &tile.texture);
+	glBindTexture(GL_TEXTURE_2D, tile.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	const FormatInfo& info = kFormats[static_cast<int>(mFormat)];
+	glTexImage2D(GL_TEXTURE_2D, 0, info.internal_format, kTileSize, kTileSize, 0, info.format, info.type, nullptr);
+	if (mFormat == CanvasFormat::R8)
+	{
+		// Coverage reads back as gray when sampled
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+	}
+
+	glGenFramebuffers(1, &tile.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, tile.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tile.texture, 0);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void Canvas::free_tile(Tile& tile)
+{
+	if (!tile.framebuffer)
+		return;
+	glDeleteFramebuffers(1, &tile.framebuffer);
+	glDeleteTextures(1, &tile.texture);
+	tile.framebuffer = 0u;
+	tile.texture = 0u;
+}
+
+void Canvas::mark_ancestors_dirty(int x, int y)
+{
+	// A dirty tile always has dirty ancestors, so we can stop at the first one
+	for (int level = 1; level < kLevelCount; ++level)
+	{
+		x = parent_coordinate(x);
+		y = parent_coordinate(y);
+		Tile& tile = mTiles[tile_key(level, x, y)];
+		if (tile.dirty)
+			return;
+		tile.dirty = true;
+	}
+}
+
+GLenum Canvas::internal_format() const
+{
+	return kFormats[static_cast<int>(mFormat)].internal_format;
+}
+
+size_t Canvas::tile_bytes() const
+{
+	return kTileSize * kTileSize * kFormats[static_cast<int>(mFormat)].pixel_bytes;
+}
+
+GLenum Canvas::client_format() const
+{
+	return kFormats[static_cast<int>(mFormat)].format;
+}
+
+GLenum Canvas::client_type() const
+{
+	return kFormats[static_cast<int>(mFormat)].type;
+}
+
+size_t Canvas::pixel_bytes() const
+{
+	return kFormats[static_cast<int>(mFormat)].pixel_bytes;
+}
+
+const char* Canvas::format_name(CanvasFormat format)
+{
+	return kFormats[static_cast<int>(format)].name;
+}
+
+bool Canvas::parse_format(const char* name, CanvasFormat& format)
+{
+	const int format_count = sizeof(kFormats) / sizeof(FormatInfo);
+	for (int i = 0; i < format_count; ++i)
+	{
+		if (strcmp(name, kFormats[i].name) == 0)
+		{
+			format = static_cast<CanvasFormat>(i);
+			return true;
+		}
+	}
+	return false;
+}
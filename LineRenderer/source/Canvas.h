@@ -0,0 +1,135 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <math.h>
+#include <stddef.h>
+#include <unordered_map>
+#include <vector>
+
+// Tile storage, picked once at startup. Colors are premultiplied by coverage over an
+// opaque black background, R8 keeps coverage alone and shows it as gray
+enum class CanvasFormat
+{
+	RGBA8,
+	RGB10A2,
+	RGBA16F,
+	R8
+};
+
+// Block of the canvas with its own texture. Level 0 tiles are allocated the first time
+// a line touches them, coarser levels are downsampled from their four children and
+// finer detail levels (negative) are rasterized from the line model while zoomed in
+struct Tile
+{
+	GLuint framebuffer = 0u;
+	GLuint texture = 0u;
+	bool dirty = false;	// Coarser levels: children changed. Detail levels: not fully rasterized
+	unsigned long long last_used = 0u;		// Residency frame of the last access
+	std::vector<unsigned char> compressed;	// Contents while the GL storage is released
+};
+
+// Level 0 tile holding contents. Compressed points at the data of a cold tile and is null
+// for one on the GPU, valid until the canvas changes
+struct StoredTile
+{
+	int x, y;
+	const std::vector<unsigned char>* compressed;
+};
+
+// Sparse pyramid of fixed size tiles. Canvas coordinates are pixels with y up, a tile
+// (x, y) of level L covers [x, x + 1) * tile_span(L) on each axis
+class Canvas
+{
+public:
+	static const int kTileSize = 256;
+	static const int kLevelCount = 12;
+	static const int kDetailLevelCount = 6;
+
+	// Frames without access before a tile is compressed, and tiles read back for it at once
+	static const unsigned long long kColdFrames = 300u;
+	static const int kCompressPerFrame = 2;
+
+	// Both count as an access and bring a compressed tile back to the GPU first
+	Tile* find_tile(int level, int x, int y);
+	// Allocates the tile cleared to black if needed, which leaves its framebuffer bound
+	Tile& acquire_tile(int level, int x, int y);
+	void release_tile(int level, int x, int y);
+	void release();
+	// Swaps storage with a tile kept outside the canvas, a tile without storage on either
+	// side stands for one that is not allocated
+	void exchange_tile(int level, int x, int y, Tile& other);
+
+	// Storage for a tile owned elsewhere, allocating leaves its framebuffer bound
+	bool allocate_tile(Tile& tile) const;
+	static void free_tile(Tile& tile);
+
+	// Only before the first tile is allocated
+	void set_format(CanvasFormat format) { mFormat = format; }
+	CanvasFormat format() const { return mFormat; }
+	GLenum internal_format() const;
+	size_t tile_bytes() const;
+	// Client side layout tiles are read back and uploaded in
+	GLenum client_format() const;
+	GLenum client_type() const;
+	size_t pixel_bytes() const;
+	static const char* format_name(CanvasFormat format);
+	static bool parse_format(const char* name, CanvasFormat& format);
+
+	// Level 0 tile from saved contents in the layout of client_format and client_type.
+	// Compressed ones stay cold until first used, raw ones are uploaded right away
+	void load_tile(int x, int y, const unsigned char* data, size_t size, bool compressed);
+	void stored_tiles(std::vector<StoredTile>& tiles) const;
+	bool stored_tile(int x, int y, StoredTile& tile) const;
+
+	// Flags every coarser tile covering a level 0 tile as needing a downsample
+	void mark_ancestors_dirty(int x, int y);
+
+	// Reads back tiles of level 0 and up that went unused for kColdFrames into a pixel
+	// buffer, and once its fence has signaled in a later frame compresses them on the CPU
+	// and releases their GL storage. A tile used meanwhile stays. Called once per frame
+	void update_residency();
+
+	// Level 0 tiles spanning everything drawn, false when nothing is
+	bool drawn_bounds(int& min_x, int& min_y, int& max_x, int& max_y) const;
+
+	size_t tile_count() const { return mAllocatedTiles; }
+	size_t compressed_tile_count() const { return mCompressedTiles; }
+	size_t memory_usage() const { return mAllocatedTiles * tile_bytes() + mCompressedBytes; }
+
+	// Canvas pixels covered by one tile of the level
+	static float tile_span(int level) { return ldexpf(static_cast<float>(kTileSize), level); }
+	// Tile of the level containing a canvas coordinate
+	static int tile_coordinate(int level, float canvas) { return static_cast<int>(floorf(canvas / tile_span(level))); }
+	// Parent tile coordinate one level up, rounding towards negative infinity
+	static int parent_coordinate(int coordinate) { return coordinate >> 1; }
+
+private:
+	// Cold tile on its way to the CPU
+	struct Eviction
+	{
+		long long key = 0;
+		unsigned long long last_used = 0u;	// Any access since the copy started keeps the tile
+		GLuint buffer = 0u;
+		GLsync fence = nullptr;
+	};
+
+	void restore_tile(Tile& tile);
+	void finish_eviction(Eviction& eviction);
+	static int key_level(long long key) { return static_cast<signed char>(key >> 56); }
+	static int key_x(long long key) { return static_cast<int>(static_cast<unsigned int>(key >> 28) << 4) >> 4; }
+	static int key_y(long long key) { return static_cast<int>(static_cast<unsigned int>(key) << 4) >> 4; }
+	static long long tile_key(int level, int x, int y)
+	{
+		return (static_cast<long long>(level & 0xff) << 56) | (static_cast<long long>(x & 0xfffffff) << 28) | (y & 0xfffffff);
+	}
+
+	std::unordered_map<long long, Tile> mTiles;
+	std::vector<unsigned char> mPixels;	// Readback and decompression scratch
+	Eviction mEvictions[kCompressPerFrame];
+	unsigned long long mFrame = 0u;
+	size_t mAllocatedTiles = 0u;
+	size_t mCompressedTiles = 0u;
+	size_t mCompressedBytes = 0u;
+	CanvasFormat mFormat = CanvasFormat::RGBA8;
+};
@@ -0,0 +1,196 @@
+#include "CanvasSnapshot.h"
+#include "TileCodec.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <io.h>
+#include <string.h>
+
+static const char kSnapshotMagic[8] = { 'L', 'I', 'N', 'E', 'S', 'N', 'A', 'P' };
+
+// Raw tiles start on page boundaries
+static const unsigned long long kRawAlignment = 4096u;
+
+bool SnapshotWriter::begin(const char* path, CanvasFormat format, size_t tile_bytes, unsigned long long document_id, unsigned long long parent_id, bool compress)
+{
+	abort();
+	strncpy(mPath, path, sizeof(mPath) - 1u);
+	snprintf(mTemporary, sizeof(mTemporary), "%s.tmp", path);
+	mAppend = parent_id != 0u;
+	if (mAppend)
+	{
+		mFile = fopen(path, "r+b");
+		if (!mFile)
+			mFile = fopen(path, "w+b");
+		if (mFile && _fseeki64(mFile, 0, SEEK_END) != 0)
+		{
+			fclose(mFile);
+			mFile = nullptr;
+		}
+	}
+	else
+	{
+		mFile = fopen(mTemporary, "wb");
+	}
+	if (!mFile)
+	{
+		fprintf(stdout, "Could not write snapshot %s.\n", mAppend ? mPath : mTemporary);
+		return false;
+	}
+
+	memset(&mHeader, 0, sizeof(mHeader));
+	memcpy(mHeader.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+	mHeader.version = kSnapshotVersion;
+	mHeader.format = static_cast<unsigned int>(format);
+	mHeader.tile_size = Canvas::kTileSize;
+	mHeader.document_id = document_id;
+	mHeader.parent_id = parent_id;
+	mTileBytes = tile_bytes;
+	mCompress = compress;
+	mFailed = false;
+	mEntries.clear();
+
+	// The real header goes in last, until then the record reads as incomplete
+	static const SnapshotHeader placeholder = {};
+	mRecordStart = mAppend ? static_cast<unsigned long long>(_ftelli64(mFile)) : 0u;
+	mFailed = fwrite(&placeholder, sizeof(placeholder), 1u, mFile) != 1u;
+	mOffset = mRecordStart + sizeof(placeholder);
+	return !mFailed;
+}
+
+void SnapshotWriter::add_tile(int x, int y, const unsigned char* pixels)
+{
+	if (mCompress)
+	{
+		TileCodec::compress(pixels, mTileBytes, mScratch);
+		if (mScratch.size() < mTileBytes)
+		{
+			write(x, y, mScratch.data(), mScratch.size(), true);
+			return;
+		}
+	}
+	write(x, y, pixels, mTileBytes, false);
+}
+
+void SnapshotWriter::add_compressed(int x, int y, const unsigned char* data, size_t size)
+{
+	if (mCompress)
+	{
+		write(x, y, data, size, true);
+		return;
+	}
+	mScratch.resize(mTileBytes);
+	if (!TileCodec::decompress(data, size, mScratch.data(), mScratch.size()))
+	{
+		fprintf(stdout, "Compressed tile (%d, %d) failed to decode, left out of the snapshot.\n", x, y);
+		return;
+	}
+	write(x, y, mScratch.data(), mScratch.size(), false);
+}
+
+void SnapshotWriter::add_removed(int x, int y)
+{
+	write(x, y, nullptr, 0u, false);
+}
+
+void SnapshotWriter::write(int x, int y, const unsigned char* data, size_t size, bool compressed)
+{
+	if (!mFile || mFailed)
+		return;
+
+	static const unsigned char padding[kRawAlignment] = {};
+	if (!compressed && size > 0u && mOffset % kRawAlignment != 0u)
+	{
+		size_t pad = static_cast<size_t>(kRawAlignment - mOffset % kRawAlignment);
+		mFailed = fwrite(padding, 1u, pad, mFile) != pad;
+		mOffset += pad;
+	}
+
+	SnapshotEntry entry = { x, y, compressed ? 1u : 0u, static_cast<unsigned int>(size), mOffset };
+	mEntries.push_back(entry);
+	mFailed = mFailed || (size > 0u && fwrite(data, 1u, size, mFile) != size);
+	mOffset += size;
+}
+
+bool SnapshotWriter::finish()
+{
+	if (!mFile)
+		return false;
+
+	// Directory entries are read in place, so it starts 8 byte aligned
+	static const unsigned char padding[8] = {};
+	size_t pad = static_cast<size_t>((8u - mOffset % 8u) % 8u);
+	if (pad > 0u)
+		mFailed = mFailed || fwrite(padding, 1u, pad, mFile) != pad;
+	mOffset += pad;
+
+	mHeader.tile_count = static_cast<unsigned int>(mEntries.size());
+	mHeader.directory_offset = mOffset;
+	if (!mEntries.empty())
+		mFailed = mFailed || fwrite(mEntries.data(), sizeof(SnapshotEntry), mEntries.size(), mFile) != mEntries.size();
+	// The data has to be on disk before the header that makes the record valid, and the
+	// header before a full snapshot replaces the old one
+	mFailed = mFailed || fflush(mFile) != 0 || _commit(_fileno(mFile)) != 0;
+	mFailed = mFailed || _fseeki64(mFile, static_cast<long long>(mRecordStart), SEEK_SET) != 0 || fwrite(&mHeader, sizeof(mHeader), 1u, mFile) != 1u;
+	mFailed = mFailed || fflush(mFile) != 0 || _commit(_fileno(mFile)) != 0;
+	mFailed = fclose(mFile) != 0 || mFailed;
+	mFile = nullptr;
+
+	if (mFailed || (!mAppend && !MoveFileExA(mTemporary, mPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)))
+	{
+		fprintf(stdout, "Could not save snapshot %s.\n", mPath);
+		if (!mAppend)
+			DeleteFileA(mTemporary);
+		return false;
+	}
+	return true;
+}
+
+void SnapshotWriter::abort()
+{
+	if (!mFile)
+		return;
+	fclose(mFile);
+	mFile = nullptr;
+	if (!mAppend)
+		DeleteFileA(mTemporary);
+}
+
+bool SnapshotReader::open(const char* path)
+{
+	if (!mFile.open(path))
+		return false;
+	mNext = 0u;
+	if (next())
+		return true;
+	fprintf(stdout, "%s is not a snapshot this version can read.\n", path);
+	close();
+	return false;
+}
+
+bool SnapshotReader::next()
+{
+	// Everything the directory points at has to be inside the record
+	size_t start = mNext, size = mFile.size();
+	if (size - start < sizeof(SnapshotHeader))
+		return false;
+	const SnapshotHeader& record = *reinterpret_cast<const SnapshotHeader*>(mFile.data() + start);
+	size_t data_start = start + sizeof(SnapshotHeader);
+	bool valid = memcmp(record.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) == 0 &&
+		record.version <= kSnapshotVersion && record.tile_size == Canvas::kTileSize &&
+		record.directory_offset >= data_start && record.directory_offset <= size && record.directory_offset % 8u == 0u &&
+		record.tile_count <= (size - record.directory_offset) / sizeof(SnapshotEntry);
+	const SnapshotEntry* directory = reinterpret_cast<const SnapshotEntry*>(mFile.data() + (valid ? record.directory_offset : 0u));
+	for (unsigned int i = 0u; valid && i < record.tile_count; ++i)
+	{
+		const SnapshotEntry& entry = directory[i];
+		valid = entry.offset >= data_start && entry.offset <= record.directory_offset && entry.size <= record.directory_offset - entry.offset;
+	}
+	if (!valid)
+		return false;
+
+	mRecord = start;
+	mNext = static_cast<size_t>(record.directory_offset) + record.tile_count * sizeof(SnapshotEntry);
+	return true;
+}
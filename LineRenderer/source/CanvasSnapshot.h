@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Canvas.h"
+#include "MappedFile.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+// Snapshot record layout, little endian: header, tile data, then the directory. Raw tiles
+// start on a 4 KB boundary of the file so they can be uploaded straight from a mapping,
+// compressed ones are TileCodec output. A full snapshot is a file with one record, a
+// delta file is a run of records each holding the tiles changed since the one before.
+// Offsets are from the start of the file
+struct SnapshotHeader
+{
+	char magic[8];					// "LINESNAP"
+	unsigned int version;			// kSnapshotVersion, readers reject newer ones
+	unsigned int format;			// CanvasFormat of the tiles
+	unsigned int tile_size;
+	unsigned int tile_count;
+	unsigned long long document_id;	// Save id of the line document the tiles show
+	unsigned long long directory_offset;
+	unsigned long long parent_id;	// Save id the delta applies on top of, 0 for a full snapshot
+	unsigned char reserved[16];
+};
+static_assert(sizeof(SnapshotHeader) == 64, "Snapshot header is 64 bytes");
+
+struct SnapshotEntry
+{
+	int x, y;					// Level 0 tile
+	unsigned int compressed;	// 1 for TileCodec data, 0 for raw pixels
+	unsigned int size;			// 0 for a tile a delta removes
+	unsigned long long offset;
+};
+static_assert(sizeof(SnapshotEntry) == 24, "Snapshot entry is 24 bytes");
+
+static const unsigned int kSnapshotVersion = 1u;
+
+// Writes a full snapshot through a temporary file renamed on finish, or appends a delta
+// record whose header only becomes valid once everything else is on disk. Not thread
+// safe, but any single thread may use it at a time
+class SnapshotWriter
+{
+public:
+	~SnapshotWriter() { abort(); }
+
+	// Deltas are the records with a parent save id
+	bool begin(const char* path, CanvasFormat format, size_t tile_bytes, unsigned long long document_id, unsigned long long parent_id, bool compress);
+	// Raw tile contents, compressed first when enabled and it helps
+	void add_tile(int x, int y, const unsigned char* pixels);
+	// Tile already compressed with TileCodec, decompressed first when compression is off
+	void add_compressed(int x, int y, const unsigned char* data, size_t size);
+	void add_removed(int x, int y);
+	bool finish();
+	// An abandoned delta stays in the file as a record readers stop at
+	void abort();
+
+	size_t tile_count() const { return mEntries.size(); }
+	unsigned long long record_bytes() const { return mOffset - mRecordStart; }
+
+private:
+	void write(int x, int y, const unsigned char* data, size_t size, bool compressed);
+
+	FILE* mFile = nullptr;
+	char mPath[260] = {};
+	char mTemporary[272] = {};
+	SnapshotHeader mHeader = {};
+	size_t mTileBytes = 0u;
+	bool mCompress = false;
+	bool mAppend = false;
+	bool mFailed = false;
+	unsigned long long mRecordStart = 0u;
+	unsigned long long mOffset = 0u;
+	std::vector<SnapshotEntry> mEntries;
+	std::vector<unsigned char> mScratch;
+};
+
+// Mapped snapshot or delta file, tile data is read in by the first upload touching it
+class SnapshotReader
+{
+public:
+	// Positioned on the first record
+	bool open(const char* path);
+	void close() { mFile.close(); }
+	// Moves to the record after, false at the end of the file or at one left incomplete
+	bool next();
+	bool at_end() const { return mNext == mFile.size(); }
+	size_t size() const { return mFile.size(); }
+
+	const SnapshotHeader& header() const { return *reinterpret_cast<const SnapshotHeader*>(mFile.data() + mRecord); }
+	const SnapshotEntry* entries() const { return reinterpret_cast<const SnapshotEntry*>(mFile.data() + header().directory_offset); }
+	const unsigned char* data(const SnapshotEntry& entry) const { return mFile.data() + entry.offset; }
+
+private:
+	MappedFile mFile;
+	size_t mRecord = 0u;
+	size_t mNext = 0u;	// Where the record after starts
+};
@@ -0,0 +1,186 @@
+#include "FrameRecorder.h"
+#include "ImageWriter.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <time.h>
+
+bool FrameRecorder::start(FrameFormat format)
+{
+	stop();
+
+	// One directory per recording, named after when it started
+	char name[64];
+	time_t now = time(nullptr);
+	strftime(name, sizeof(name), "capture_%Y%m%d_%H%M%S", localtime(&now));
+	if (!CreateDirectoryA(name, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		fprintf(stdout, "Could not create %s, not recording.\n", name);
+		return false;
+	}
+	mDirectory = name;
+	mIndex = fopen((mDirectory + "/frames.txt").c_str(), "w");
+	if (!mIndex)
+	{
+		fprintf(stdout, "Could not write %s/frames.txt, not recording.\n", name);
+		return false;
+	}
+	fprintf(mIndex, "# file width height milliseconds\n");
+
+	mFormat = format;
+	mStart = std::chrono::steady_clock::now();
+	mFramesShown = mFramesWritten = 0u;
+	mDroppedReadback = mDroppedQueue = 0u;
+	mEncodeTime = 0.0;
+	mFailed = false;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFree.assign(kQueuedFrames, Frame());
+		mQueued.clear();
+		++mSession;
+		mReadbacks = 0;
+		mStop = false;
+	}
+	mWriter = std::thread(&FrameRecorder::write_loop, this);
+	mRecording = true;
+	fprintf(stdout, "Recording frames to %s\n", name);
+	return true;
+}
+
+void FrameRecorder::stop()
+{
+	if (!mRecording)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mFrameReady.notify_one();
+	mWriter.join();
+	fclose(mIndex);
+	mIndex = nullptr;
+	mRecording = false;
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - mStart;
+	fprintf(stdout, "Recorded %u of %u frames to %s in %.1f s, %u dropped waiting for readback and %u for the writer, %.1f ms to write each\n",
+		mFramesWritten, mFramesShown, mDirectory.c_str(), elapsed.count(), mDroppedReadback, mDroppedQueue, mFramesWritten ? mEncodeTime / mFramesWritten : 0.0);
+	if (mFailed)
+		fprintf(stdout, "Some frames could not be written.\n");
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<Frame>().swap(mFree);
+	mQueued.clear();
+}
+
+bool FrameRecorder::begin_frame(ReadbackCallback& callback)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	++mFramesShown;
+	if (mReadbacks >= kMaxReadbacks)
+	{
+		++mDroppedReadback;
+		return false;
+	}
+	++mReadbacks;
+
+	std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - mStart;
+	unsigned int session = mSession;
+	double milliseconds = time.count();
+	callback = [this, milliseconds, session](const ReadbackImage& image) { queue(image, milliseconds, session); };
+	return true;
+}
+
+void FrameRecorder::cancel_frame()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	--mReadbacks;
+	++mDroppedReadback;
+}
+
+void FrameRecorder::queue(const ReadbackImage& image, double time, unsigned int session)
+{
+	// Runs on the readback worker, the copy is the only work done there
+	Frame frame;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (session != mSession || mStop)
+			return;
+		--mReadbacks;
+		if (mFree.empty())
+		{
+			++mDroppedQueue;
+			return;
+		}
+		frame = std::move(mFree.back());
+		mFree.pop_back();
+	}
+	frame.pixels.assign(image.pixels.begin(), image.pixels.end());
+	frame.width = image.width;
+	frame.height = image.height;
+	frame.time = time;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQueued.push_back(std::move(frame));
+	}
+	mFrameReady.notify_one();
+}
+
+void FrameRecorder::write_loop()
+{
+	unsigned int number = 0u;
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		// Frames queued before stopping are still written
+		mFrameReady.wait(lock, [this]() { return mStop || !mQueued.empty(); });
+		if (mQueued.empty())
+			return;
+		Frame frame = std::move(mQueued.front());
+		mQueued.pop_front();
+		lock.unlock();
+
+		auto start = std::chrono::high_resolution_clock::now();
+		bool written = write_frame(frame, ++number);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		lock.lock();
+		mEncodeTime += elapsed.count();
+		mFramesWritten += written ? 1u : 0u;
+		mFailed = mFailed || !written;
+		mFree.push_back(std::move(frame));
+	}
+}
+
+bool FrameRecorder::write_frame(const Frame& frame, unsigned int number)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "frame_%06u.%s", number, mFormat == FrameFormat::QOI ? "qoi" : "rgba");
+	std::string path = mDirectory + "/" + name;
+
+	// Readback rows are bottom up, files are top down
+	size_t row_bytes = static_cast<size_t>(frame.width) * 4u;
+	const unsigned char* last_row = frame.pixels.data() + (frame.height - 1) * row_bytes;
+	bool written;
+	if (mFormat == FrameFormat::QOI)
+	{
+		// Encoded right here, the writer thread is already off the render thread
+		ImageWriter writer;
+		written = writer.open(path.c_str(), ImageFormat::QOI, frame.width, frame.height, false);
+		written = writer.write_rows(last_row, frame.height, -static_cast<ptrdiff_t>(row_bytes)) && written;
+		written = writer.close() && written;
+	}
+	else
+	{
+		FILE* file = fopen(path.c_str(), "wb");
+		written = file != nullptr;
+		for (int row = 0; written && row < frame.height; ++row)
+			written = fwrite(last_row - row * row_bytes, 1u, row_bytes, file) == row_bytes;
+		written = file && fclose(file) == 0 && written;
+	}
+	if (written)
+	{
+		fprintf(mIndex, "%s %d %d %.1f\n", name, frame.width, frame.height, frame.time);
+		fflush(mIndex);
+	}
+	return written;
+}
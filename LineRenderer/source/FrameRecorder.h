@@ -0,0 +1,82 @@
+#pragma once
+
+#include "AsyncReadback.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Files recorded frames are written as
+enum class FrameFormat
+{
+	Raw,	// RGBA8 rows top down, no header, cheapest to write
+	QOI
+};
+
+// Records presented frames as numbered image files in a directory of their own, with an
+// index of when each was shown. A frame goes through three stages: a window readback,
+// a copy into one of kQueuedFrames buffers on the readback worker, and encoding on the
+// recorder's writer thread. Each stage is bounded and a frame that finds the next one
+// full is dropped, so a slow disk costs frames rather than memory or frame time
+class FrameRecorder
+{
+public:
+	static const int kMaxReadbacks = 3;	// Frames being read back at once
+	static const int kQueuedFrames = 4;	// Frames copied out and waiting for the writer
+
+	~FrameRecorder() { stop(); }
+
+	bool start(FrameFormat format);
+	// Writes the frames already queued and prints what was recorded
+	void stop();
+	bool is_recording() const { return mRecording; }
+
+	// Called for each presented frame on the render thread. False when it has to be
+	// dropped, otherwise the readback callback returned hands it on and must run once
+	bool begin_frame(ReadbackCallback& callback);
+	// The readback begin_frame reserved could not start
+	void cancel_frame();
+
+private:
+	struct Frame
+	{
+		std::vector<unsigned char> pixels;
+		int width = 0;
+		int height = 0;
+		double time = 0.0;	// Milliseconds since recording started
+	};
+
+	void queue(const ReadbackImage& image, double time, unsigned int session);
+	void write_loop();
+	bool write_frame(const Frame& frame, unsigned int number);
+
+	FrameFormat mFormat = FrameFormat::QOI;
+	std::string mDirectory;
+	FILE* mIndex = nullptr;
+	std::chrono::steady_clock::time_point mStart;
+	bool mRecording = false;
+
+	// Frames are moved between the free buffers and the queue, the writer takes the
+	// oldest queued one
+	std::thread mWriter;
+	std::mutex mMutex;
+	std::condition_variable mFrameReady;
+	std::vector<Frame> mFree;
+	std::deque<Frame> mQueued;
+	unsigned int mSession = 0u;	// Readbacks of an earlier recording are ignored
+	int mReadbacks = 0;
+	bool mStop = false;
+
+	// Stats, read once the writer has stopped
+	unsigned int mFramesShown = 0u;
+	unsigned int mFramesWritten = 0u;
+	unsigned int mDroppedReadback = 0u;
+	unsigned int mDroppedQueue = 0u;
+	double mEncodeTime = 0.0;
+	bool mFailed = false;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <math.h>
+
+// Whether segment a-b comes within distance of the rectangle [min, max]. Clips the
+// segment against the rectangle grown by distance, so it is conservative at corners
+inline bool segment_near_rect(float ax, float ay, float bx, float by, float distance,
+	float min_x, float min_y, float max_x, float max_y)
+{
+	min_x -= distance; min_y -= distance;
+	max_x += distance; max_y += distance;
+
+	// Liang-Barsky clipping of the segment parameter range
+	float t0 = 0.0f, t1 = 1.0f;
+	float dx = bx - ax, dy = by - ay;
+	float p[4] = { -dx, dx, -dy, dy };
+	float q[4] = { ax - min_x, max_x - ax, ay - min_y, max_y - ay };
+	for (int i = 0; i < 4; ++i)
+	{
+		if (p[i] == 0.0f)
+		{
+			if (q[i] < 0.0f)
+				return false;
+			continue;
+		}
+
+		float t = q[i] / p[i];
+		if (p[i] < 0.0f)
+			t0 = t > t0 ? t : t0;
+		else
+			t1 = t < t1 ? t : t1;
+		if (t0 > t1)
+			return false;
+	}
+	return true;
+}
+
+// Distance from point p to segment a-b, same as udSegment in the SDF shader
+inline float point_segment_distance(float px, float py, float ax, float ay, float bx, float by)
+{
+	float bax = bx - ax, bay = by - ay;
+	float pax = px - ax, pay = py - ay;
+	float length_squared = bax * bax + bay * bay;
+	float h = length_squared > 0.0f ? (pax * bax + pay * bay) / length_squared : 0.0f;
+	h = h < 0.0f ? 0.0f : (h > 1.0f ? 1.0f : h);
+	float x = pax - h * bax, y = pay - h * bay;
+	return sqrtf(x * x + y * y);
+}
@@ -0,0 +1,602 @@
+#include "ImageWriter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Deflate with the fixed Huffman codes, greedy LZ77 over a 32 KB window
+static const int kLengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const int kLengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int kDistanceBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const int kDistanceExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const int kWindowSize = 32768;
+static const int kMaxMatch = 258;
+static const int kHashBits = 15;
+
+// Deflate packs bits starting from the least significant one
+class BitWriter
+{
+public:
+	explicit BitWriter(std::vector<unsigned char>& out) : mOut(out) {}
+
+	void put(unsigned int value, int count)
+	{
+		mBits |= static_cast<unsigned long long>(value) << mCount;
+		mCount += count;
+		while (mCount >= 8)
+		{
+			mOut.push_back(static_cast<unsigned char>(mBits));
+			mBits >>= 8;
+			mCount -= 8;
+		}
+	}
+	// Huffman codes go most significant bit first
+	void put_code(unsigned int code, int length)
+	{
+		unsigned int reversed = 0u;
+		for (int i = 0; i < length; ++i)
+			reversed |= ((code >> i) & 1u) << (length - 1 - i);
+		put(reversed, length);
+	}
+	void align()
+	{
+		if (mCount > 0)
+			put(0u, 8 - mCount);
+	}
+
+private:
+	std::vector<unsigned char>& mOut;
+	unsigned long long mBits = 0u;
+	int mCount = 0;
+};
+
+static void put_symbol(BitWriter& bits, int symbol)
+{
+	if (symbol <= 143)
+		bits.put_code(0x30 + symbol, 8);
+	else if (symbol <= 255)
+		bits.put_code(0x190 + symbol - 144, 9);
+	else if (symbol <= 279)
+		bits.put_code(symbol - 256, 7);
+	else
+		bits.put_code(0xc0 + symbol - 280, 8);
+}
+
+// One fixed Huffman block followed by an empty stored block, so the output ends on a byte
+// boundary and the next strip's blocks can simply be appended
+static void deflate_strip(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+	BitWriter bits(out);
+	bits.put(2u, 3);	// Not final, fixed codes
+
+	std::vector<int> head(static_cast<size_t>(1) << kHashBits, -kWindowSize - 1);
+	auto hash = [data](size_t i)
+	{
+		unsigned int value = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+		return (value * 2654435761u) >> (32 - kHashBits);
+	};
+
+	size_t i = 0u;
+	while (i < size)
+	{
+		int length = 0;
+		int distance = 0;
+		if (i + 3u <= size)
+		{
+			unsigned int h = hash(i);
+			int candidate = head[h];
+			head[h] = static_cast<int>(i);
+			distance = static_cast<int>(i) - candidate;
+			if (distance <= kWindowSize)
+			{
+				size_t limit = size - i < static_cast<size_t>(kMaxMatch) ? size - i : static_cast<size_t>(kMaxMatch);
+				const unsigned char* a = data + candidate;
+				const unsigned char* b = data + i;
+				while (static_cast<size_t>(length) < limit && a[length] == b[length])
+					++length;
+			}
+		}
+
+		if (length < 3)
+		{
+			put_symbol(bits, data[i]);
+			++i;
+			continue;
+		}
+
+		int code = 28;
+		while (kLengthBase[code] > length)
+			--code;
+		put_symbol(bits, 257 + code);
+		bits.put(length - kLengthBase[code], kLengthExtra[code]);
+		code = 29;
+		while (kDistanceBase[code] > distance)
+			--code;
+		bits.put_code(code, 5);
+		bits.put(distance - kDistanceBase[code], kDistanceExtra[code]);
+
+		// Positions inside the match are findable too
+		for (size_t end = i + length; ++i < end;)
+			if (i + 3u <= size)
+				head[hash(i)] = static_cast<int>(i);
+	}
+	put_symbol(bits, 256);
+
+	bits.put(0u, 3);	// Empty stored block
+	bits.align();
+	out.push_back(0x00);
+	out.push_back(0x00);
+	out.push_back(0xff);
+	out.push_back(0xff);
+}
+
+static unsigned int adler32(unsigned int adler, const unsigned char* data, size_t size)
+{
+	unsigned int a = adler & 0xffff, b = adler >> 16;
+	while (size > 0u)
+	{
+		// Largest run that can't overflow before the modulo
+		size_t run = size < 5552u ? size : 5552u;
+		size -= run;
+		for (; run > 0u; --run)
+		{
+			a += *data++;
+			b += a;
+		}
+		a %= 65521u;
+		b %= 65521u;
+	}
+	return a | (b << 16);
+}
+
+// Adler-32 of two blocks one after the other, from the sum of each and the second's size
+static unsigned int adler32_combine(unsigned int first, unsigned int second, size_t second_size)
+{
+	const unsigned int base = 65521u;
+	unsigned int remainder = static_cast<unsigned int>(second_size % base);
+	unsigned int a = first & 0xffff;
+	unsigned int b = static_cast<unsigned int>((static_cast<unsigned long long>(remainder) * a) % base);
+	a += (second & 0xffff) + base - 1u;
+	b += (first >> 16) + (second >> 16) + base - remainder;
+	if (a >= base)
+		a -= base;
+	if (a >= base)
+		a -= base;
+	if (b >= base * 2u)
+		b -= base * 2u;
+	if (b >= base)
+		b -= base;
+	return a | (b << 16);
+}
+
+static unsigned int crc32(unsigned int crc, const unsigned char* data, size_t size)
+{
+	static unsigned int table[256];
+	static bool initialized = [&]()
+	{
+		for (unsigned int n = 0u; n < 256u; ++n)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1u ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return true;
+	}();
+	(void)initialized;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_u32(std::vector<unsigned char>& out, unsigned int value)
+{
+	out.push_back(static_cast<unsigned char>(value >> 24));
+	out.push_back(static_cast<unsigned char>(value >> 16));
+	out.push_back(static_cast<unsigned char>(value >> 8));
+	out.push_back(static_cast<unsigned char>(value));
+}
+
+// Length, type, data and CRC, with the data already placed after 8 reserved bytes
+static void finish_chunk(std::vector<unsigned char>& chunk, const char* type)
+{
+	unsigned int length = static_cast<unsigned int>(chunk.size() - 8u);
+	for (int i = 0; i < 4; ++i)
+	{
+		chunk[i] = static_cast<unsigned char>(length >> (24 - i * 8));
+		chunk[4 + i] = static_cast<unsigned char>(type[i]);
+	}
+	put_u32(chunk, crc32(0u, chunk.data() + 4, chunk.size() - 4u));
+}
+
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+static unsigned int qoi_hash(const unsigned char* pixel)
+{
+	return (pixel[0] * 3u + pixel[1] * 5u + pixel[2] * 7u + pixel[3] * 11u) % 64u;
+}
+
+bool ImageWriter::open(const char* path, ImageFormat format, int width, int height, bool threaded)
+{
+	close();
+	mFile = fopen(path, "wb");
+	if (!mFile)
+	{
+		fprintf(stdout, "Could not create image %s.\n", path);
+		return false;
+	}
+
+	mFormat = format;
+	mWidth = width;
+	mHeight = height;
+	size_t row_bytes = static_cast<size_t>(width) * 4u;
+	mStripRows = static_cast<int>(kStripBytes / row_bytes > 0u ? kStripBytes / row_bytes : 1u);
+	mRowsSubmitted = 0;
+	mCurrent.reset();
+	mCurrentRows = 0;
+	mPrevious.reset();
+	mAdler = 1u;
+	mFailed = false;
+	mFirstStrip = mNextEncode = 0u;
+	mStop = false;
+
+	std::vector<unsigned char> header;
+	if (format == ImageFormat::PNG)
+	{
+		static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		header.assign(signature, signature + 8);
+		std::vector<unsigned char> chunk(8u);
+		put_u32(chunk, width);
+		put_u32(chunk, height);
+		chunk.push_back(8);	// Bits per channel
+		chunk.push_back(6);	// RGBA
+		chunk.push_back(0);
+		chunk.push_back(0);
+		chunk.push_back(0);
+		finish_chunk(chunk, "IHDR");
+		header.insert(header.end(), chunk.begin(), chunk.end());
+	}
+	else
+	{
+		header.push_back('q');
+		header.push_back('o');
+		header.push_back('i');
+		header.push_back('f');
+		put_u32(header, width);
+		put_u32(header, height);
+		header.push_back(4);	// RGBA
+		header.push_back(0);	// sRGB
+	}
+	mFailed = fwrite(header.data(), 1u, header.size(), mFile) != header.size();
+
+	unsigned int workers = 0u;
+	if (threaded)
+	{
+		workers = std::thread::hardware_concurrency();
+		workers = workers > 0u ? workers : 1u;
+	}
+	for (unsigned int i = 0u; i < workers; ++i)
+		mWorkers.emplace_back(&ImageWriter::encode, this);
+	return !mFailed;
+}
+
+bool ImageWriter::write_rows(const unsigned char* first_row, int rows, ptrdiff_t stride)
+{
+	if (!mFile)
+		return false;
+
+	size_t row_bytes = static_cast<size_t>(mWidth) * 4u;
+	for (int row = 0; row < rows && mRowsSubmitted + mCurrentRows < mHeight; ++row)
+	{
+		if (!mCurrent)
+			mCurrent = std::make_shared<std::vector<unsigned char>>(row_bytes * mStripRows);
+		memcpy(mCurrent->data() + mCurrentRows * row_bytes, first_row + row * stride, row_bytes);
+		if (++mCurrentRows == mStripRows)
+			submit();
+	}
+	return !mFailed;
+}
+
+bool ImageWriter::close()
+{
+	if (!mFile)
+		return false;
+
+	if (mCurrentRows > 0)
+		submit();
+	while (!mStrips.empty())
+		write_finished(true);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mStripReady.notify_all();
+	for (std::thread& worker : mWorkers)
+		worker.join();
+	mWorkers.clear();
+
+	std::vector<unsigned char> trailer;
+	if (mFormat == ImageFormat::PNG)
+	{
+		// Final empty block, then the checksum of everything before
+		std::vector<unsigned char> chunk(8u);
+		chunk.push_back(0x03);
+		chunk.push_back(0x00);
+		put_u32(chunk, mAdler);
+		finish_chunk(chunk, "IDAT");
+		trailer = chunk;
+		chunk.assign(8u, 0u);
+		finish_chunk(chunk, "IEND");
+		trailer.insert(trailer.end(), chunk.begin(), chunk.end());
+	}
+	else
+	{
+		static const unsigned char end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		trailer.assign(end_marker, end_marker + 8);
+	}
+	if (fwrite(trailer.data(), 1u, trailer.size(), mFile) != trailer.size())
+		mFailed = true;
+	if (fclose(mFile) != 0)
+		mFailed = true;
+	mFile = nullptr;
+	mCurrent.reset();
+	mPrevious.reset();
+
+	if (mRowsSubmitted != mHeight)
+	{
+		fprintf(stdout, "Image incomplete, %d of %d rows written.\n", mRowsSubmitted, mHeight);
+		mFailed = true;
+	}
+	else if (mFailed)
+		fprintf(stdout, "Could not write image.\n");
+	return !mFailed;
+}
+
+ImageFormat ImageWriter::format_from_path(const char* path)
+{
+	size_t length = strlen(path);
+	if (length >= 4u && (strcmp(path + length - 4u, ".qoi") == 0 || strcmp(path + length - 4u, ".QOI") == 0))
+		return ImageFormat::QOI;
+	return ImageFormat::PNG;
+}
+
+void ImageWriter::submit()
+{
+	// Keeps memory bounded, the oldest strip is written before another one is queued
+	while (mStrips.size() >= kMaxStrips)
+		write_finished(true);
+
+	std::unique_ptr<Strip> strip(new Strip);
+	strip->pixels = mCurrent;
+	strip->previous = mPrevious;
+	strip->rows = mCurrentRows;
+	strip->first = mRowsSubmitted == 0;
+	mRowsSubmitted += mCurrentRows;
+	mPrevious = mCurrent;
+	mCurrent.reset();
+	mCurrentRows = 0;
+	if (mWorkers.empty())
+	{
+		encode_strip(*strip);
+		strip->done = true;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStrips.push_back(std::move(strip));
+	}
+	mStripReady.notify_one();
+	write_finished(false);
+}
+
+void ImageWriter::write_finished(bool wait)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	if (wait)
+		mStripDone.wait(lock, [this]() { return mStrips.empty() || mStrips.front()->done; });
+	while (!mStrips.empty() && mStrips.front()->done)
+	{
+		std::unique_ptr<Strip> strip = std::move(mStrips.front());
+		mStrips.pop_front();
+		++mFirstStrip;
+		lock.unlock();
+
+		if (fwrite(strip->output.data(), 1u, strip->output.size(), mFile) != strip->output.size())
+			mFailed = true;
+		if (mFormat == ImageFormat::PNG)
+			mAdler = adler32_combine(mAdler, strip->adler, strip->filtered_size);
+		lock.lock();
+	}
+}
+
+void ImageWriter::encode()
+{
+	for (;;)
+	{
+		Strip* strip = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mStripReady.wait(lock, [this]() { return mStop || mNextEncode < mFirstStrip + mStrips.size(); });
+			if (mNextEncode == mFirstStrip + mStrips.size())
+				return;
+			strip = mStrips[mNextEncode++ - mFirstStrip].get();
+		}
+
+		// Strips stay queued until done, so the pointer can be used without the lock
+		encode_strip(*strip);
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			strip->done = true;
+		}
+		mStripDone.notify_all();
+	}
+}
+
+void ImageWriter::encode_strip(Strip& strip) const
+{
+	if (mFormat == ImageFormat::PNG)
+		encode_png(strip);
+	else
+		encode_qoi(strip);
+	strip.pixels.reset();
+	strip.previous.reset();
+}
+
+void ImageWriter::encode_png(Strip& strip) const
+{
+	// Each row gets the filter leaving the smallest residuals, the row above the first one
+	// comes from the previous strip
+	const size_t row_bytes = static_cast<size_t>(mWidth) * 4u;
+	const size_t filtered_row = row_bytes + 1u;
+	std::vector<unsigned char> filtered(filtered_row * strip.rows);
+	std::vector<unsigned char> zero_row(row_bytes, 0u);
+	std::vector<unsigned char> candidate(row_bytes);
+	for (int row = 0; row < strip.rows; ++row)
+	{
+		const unsigned char* current = strip.pixels->data() + row * row_bytes;
+		const unsigned char* above = row > 0 ? current - row_bytes :
+			(strip.previous ? strip.previous->data() + strip.previous->size() - row_bytes : zero_row.data());
+		unsigned char* out = filtered.data() + row * filtered_row;
+
+		unsigned long long best_cost = ~0ull;
+		for (int filter = 0; filter <= 4; ++filter)
+		{
+			if (filter == 3)
+				continue;	// Average rarely wins over Paeth here
+			unsigned long long cost = 0u;
+			for (size_t i = 0; i < row_bytes; ++i)
+			{
+				int left = i >= 4u ? current[i - 4u] : 0;
+				int up = above[i];
+				int up_left = i >= 4u ? above[i - 4u] : 0;
+				int predicted = filter == 0 ? 0 : filter == 1 ? left : filter == 2 ? up : paeth(left, up, up_left);
+				unsigned char value = static_cast<unsigned char>(current[i] - predicted);
+				candidate[i] = value;
+				cost += value < 128u ? value : 256u - value;
+			}
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				out[0] = static_cast<unsigned char>(filter);
+				memcpy(out + 1, candidate.data(), row_bytes);
+			}
+		}
+	}
+	strip.adler = adler32(1u, filtered.data(), filtered.size());
+	strip.filtered_size = filtered.size();
+
+	strip.output.assign(8u, 0u);
+	if (strip.first)
+	{
+		strip.output.push_back(0x78);	// zlib header, 32 KB window, no dictionary
+		strip.output.push_back(0x01);
+	}
+	deflate_strip(filtered.data(), filtered.size(), strip.output);
+	finish_chunk(strip.output, "IDAT");
+}
+
+void ImageWriter::encode_qoi(Strip& strip) const
+{
+	// Decoder state at the strip start: the previous pixel, and the index entries the
+	// previous strip's pixels set. Entries it doesn't reveal are never referenced
+	unsigned char index[64][4] = {};
+	bool known[64];
+	unsigned char previous[4] = { 0, 0, 0, 255 };
+	if (strip.previous)
+	{
+		memset(known, 0, sizeof(known));
+		const unsigned char* pixels = strip.previous->data();
+		size_t count = strip.previous->size() / 4u;
+		memcpy(previous, pixels + (count - 1u) * 4u, 4u);
+		int found = 0;
+		for (size_t i = count; i-- > 0u && found < 64;)
+		{
+			unsigned int h = qoi_hash(pixels + i * 4u);
+			if (!known[h])
+			{
+				memcpy(index[h], pixels + i * 4u, 4u);
+				known[h] = true;
+				++found;
+			}
+		}
+	}
+	else
+	{
+		for (bool& entry : known)
+			entry = true;
+	}
+
+	const unsigned char* pixel = strip.pixels->data();
+	size_t count = static_cast<size_t>(mWidth) * strip.rows;
+	std::vector<unsigned char>& out = strip.output;
+	out.reserve(count);
+	int run = 0;
+	for (size_t i = 0; i < count; ++i, pixel += 4)
+	{
+		unsigned int h = qoi_hash(pixel);
+		if (memcmp(pixel, previous, 4u) == 0)
+		{
+			// The decoder indexes the color of a run too
+			memcpy(index[h], pixel, 4u);
+			known[h] = true;
+			if (++run == 62 || i + 1u == count)
+			{
+				out.push_back(static_cast<unsigned char>(0xc0 | (run - 1)));
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0)
+		{
+			out.push_back(static_cast<unsigned char>(0xc0 | (run - 1)));
+			run = 0;
+		}
+
+		if (known[h] && memcmp(index[h], pixel, 4u) == 0)
+		{
+			out.push_back(static_cast<unsigned char>(h));
+		}
+		else if (pixel[3] == previous[3])
+		{
+			int dr = static_cast<signed char>(pixel[0] - previous[0]);
+			int dg = static_cast<signed char>(pixel[1] - previous[1]);
+			int db = static_cast<signed char>(pixel[2] - previous[2]);
+			int dr_dg = dr - dg, db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+			{
+				out.push_back(static_cast<unsigned char>(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2)));
+			}
+			else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+			{
+				out.push_back(static_cast<unsigned char>(0x80 | (dg + 32)));
+				out.push_back(static_cast<unsigned char>(((dr_dg + 8) << 4) | (db_dg + 8)));
+			}
+			else
+			{
+				out.push_back(0xfe);
+				out.insert(out.end(), pixel, pixel + 3);
+			}
+		}
+		else
+		{
+			out.push_back(0xff);
+			out.insert(out.end(), pixel, pixel + 4);
+		}
+		memcpy(index[h], pixel, 4u);
+		known[h] = true;
+		memcpy(previous, pixel, 4u);
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class ImageFormat
+{
+	PNG,
+	QOI
+};
+
+// Encodes RGBA8 rows into a PNG or QOI file as they come in. Rows are grouped into strips
+// that worker threads encode independently, and finished strips are written in order
+// while later ones are still being encoded, so only kMaxStrips strips are in memory.
+//
+// PNG strips are separate runs of deflate blocks ending on a byte boundary, stored in
+// their own IDAT chunk, and their Adler-32 sums are combined at the end. QOI strips start
+// from the last pixel of the strip before and only index colors seen in it, so their
+// concatenation is the same stream a single encoder would accept
+class ImageWriter
+{
+public:
+	static const size_t kStripBytes = 4u << 20;	// Rows per strip are chosen to about fill this
+	static const size_t kMaxStrips = 16u;
+
+	~ImageWriter() { close(); }
+
+	// Without threads strips are encoded on the calling thread, for callers that already
+	// run on a worker of their own
+	bool open(const char* path, ImageFormat format, int width, int height, bool threaded = true);
+	// Rows are given top down, stride is the distance in bytes from one to the next and
+	// negative for images stored bottom up
+	bool write_rows(const unsigned char* first_row, int rows, ptrdiff_t stride);
+	// Writes whatever is left, false if anything failed or rows are missing
+	bool close();
+
+	// PNG unless the path ends in .qoi
+	static ImageFormat format_from_path(const char* path);
+
+private:
+	typedef std::shared_ptr<std::vector<unsigned char>> Pixels;
+
+	struct Strip
+	{
+		Pixels pixels;
+		Pixels previous;	// Strip before, for PNG filters and QOI state. Null for the first
+		int rows = 0;
+		bool first = false;
+		std::vector<unsigned char> output;
+		unsigned int adler = 1u;	// Of the filtered PNG data
+		size_t filtered_size = 0u;
+		bool done = false;
+	};
+
+	void submit();
+	void write_finished(bool wait);
+	void encode();
+	void encode_strip(Strip& strip) const;
+	void encode_png(Strip& strip) const;
+	void encode_qoi(Strip& strip) const;
+
+	FILE* mFile = nullptr;
+	ImageFormat mFormat = ImageFormat::PNG;
+	int mWidth = 0;
+	int mHeight = 0;
+	int mStripRows = 0;
+	int mRowsSubmitted = 0;
+	Pixels mCurrent;	// Strip being filled
+	int mCurrentRows = 0;
+	Pixels mPrevious;
+	unsigned int mAdler = 1u;
+	bool mFailed = false;
+
+	// Strips in file order, from the oldest one not written yet
+	std::vector<std::thread> mWorkers;
+	std::mutex mMutex;
+	std::condition_variable mStripReady;
+	std::condition_variable mStripDone;
+	std::deque<std::unique_ptr<Strip>> mStrips;
+	size_t mFirstStrip = 0u;	// Sequence number of mStrips.front()
+	size_t mNextEncode = 0u;
+	bool mStop = false;
+};
@@ -0,0 +1,46 @@
+#include "LatencyRecorder.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+// Upper edges of the histogram buckets in milliseconds, last bucket is open
+static const double kBucketEdges[] = { 4.0, 8.0, 16.0, 24.0, 33.0, 50.0, 100.0 };
+static const int kBucketCount = sizeof(kBucketEdges) / sizeof(double) + 1;
+
+void LatencyRecorder::print_report(const char* name)
+{
+	if (mSamples.empty())
+		return;
+
+	std::vector<double> sorted = mSamples;
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](double p)
+	{
+		size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+		return sorted[index];
+	};
+
+	double sum = 0.0;
+	for (double sample : sorted)
+		sum += sample;
+
+	fprintf(stdout, "%s latency over %zu samples: mean %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		name, sorted.size(), sum / sorted.size(), percentile(0.5), percentile(0.9), percentile(0.99), sorted.back());
+
+	// Histogram so a shift of the whole distribution is easy to spot
+	size_t buckets[kBucketCount] = {};
+	for (double sample : sorted)
+	{
+		int bucket = 0;
+		while (bucket < kBucketCount - 1 && sample > kBucketEdges[bucket])
+			++bucket;
+		++buckets[bucket];
+	}
+	for (int i = 0; i < kBucketCount; ++i)
+	{
+		if (i < kBucketCount - 1)
+			fprintf(stdout, "  <= %5.1f ms: %zu\n", kBucketEdges[i], buckets[i]);
+		else
+			fprintf(stdout, "   > %5.1f ms: %zu\n", kBucketEdges[i - 1], buckets[i]);
+	}
+}
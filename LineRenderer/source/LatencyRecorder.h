@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Collects latency samples and prints their distribution
+class LatencyRecorder
+{
+public:
+	void add_sample(double milliseconds) { mSamples.push_back(milliseconds); }
+	void clear() { mSamples.clear(); }
+	size_t sample_count() const { return mSamples.size(); }
+	void print_report(const char* name);
+
+private:
+	std::vector<double> mSamples;
+};
@@ -0,0 +1,111 @@
+#include "LineDocument.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <io.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+static const char kLineDocumentMagic[8] = { 'L', 'I', 'N', 'E', 'D', 'O', 'C', '\0' };
+
+// Lines written per fwrite when saving
+static const size_t kSaveChunk = 65536u;
+
+bool LineDocument::open(const char* path)
+{
+	close();
+	if (!mFile.open(path))
+	{
+		fprintf(stdout, "Could not open line document %s.\n", path);
+		return false;
+	}
+	if (mFile.size() < sizeof(LineDocumentHeader))
+	{
+		fprintf(stdout, "Line document %s is too small.\n", path);
+		close();
+		return false;
+	}
+
+	const LineDocumentHeader* header = reinterpret_cast<const LineDocumentHeader*>(mFile.data());
+	unsigned long long file_size = mFile.size();
+	bool valid = memcmp(header->magic, kLineDocumentMagic, sizeof(kLineDocumentMagic)) == 0 &&
+		header->version <= kLineDocumentVersion && header->record_size == sizeof(Line) &&
+		header->records_offset % 64u == 0u && header->records_offset >= sizeof(LineDocumentHeader) &&
+		header->records_offset <= file_size &&
+		header->line_count <= (file_size - header->records_offset) / sizeof(Line);
+	if (!valid)
+	{
+		fprintf(stdout, "%s is not a line document this version can read.\n", path);
+		close();
+		return false;
+	}
+
+	mLines = reinterpret_cast<const Line*>(mFile.data() + header->records_offset);
+	mLineCount = static_cast<size_t>(header->line_count);
+	mSaveId = header->save_id;
+	strncpy(mPath, path, sizeof(mPath) - 1u);
+	return true;
+}
+
+void LineDocument::close()
+{
+	mFile.close();
+	mLines = nullptr;
+	mLineCount = 0u;
+	mSaveId = 0u;
+	mPath[0] = '\0';
+}
+
+bool LineDocument::save(const char* path, const LineStore& lines, unsigned long long& save_id)
+{
+	char temporary[272];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	FILE* file = fopen(temporary, "wb");
+	if (!file)
+	{
+		fprintf(stdout, "Could not write line document %s.\n", temporary);
+		return false;
+	}
+
+	LineDocumentHeader header = {};
+	memcpy(header.magic, kLineDocumentMagic, sizeof(kLineDocumentMagic));
+	header.version = kLineDocumentVersion;
+	header.record_size = sizeof(Line);
+	header.line_count = lines.live_count();
+	header.records_offset = sizeof(LineDocumentHeader);
+	std::random_device random;
+	header.save_id = (static_cast<unsigned long long>(random()) << 32) ^ random() ^
+		static_cast<unsigned long long>(std::chrono::system_clock::now().time_since_epoch().count());
+	header.save_id = header.save_id ? header.save_id : 1u;
+	bool written = fwrite(&header, sizeof(header), 1u, file) == 1u;
+
+	// Removed lines are left out, so ids are compacted on the next open
+	std::vector<Line> chunk;
+	chunk.reserve(kSaveChunk);
+	for (size_t id = 0u; id < lines.size() && written; ++id)
+	{
+		if (!lines.is_removed(id))
+			chunk.push_back(lines.get(id));
+		if (chunk.size() == kSaveChunk || (id + 1u == lines.size() && !chunk.empty()))
+		{
+			written = fwrite(chunk.data(), sizeof(Line), chunk.size(), file) == chunk.size();
+			chunk.clear();
+		}
+	}
+	// The journal starts over once this returns, so the lines have to be on disk first
+	written = written && fflush(file) == 0 && _commit(_fileno(file)) == 0;
+	written = fclose(file) == 0 && written;
+
+	if (!written || !MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		fprintf(stdout, "Could not save line document %s.\n", path);
+		DeleteFileA(temporary);
+		return false;
+	}
+	save_id = header.save_id;
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "LineStore.h"
+#include "MappedFile.h"
+
+#include <stddef.h>
+
+// Line document file layout, little endian. The records are Line structs exactly as
+// LineStore keeps them, so a mapped file is used in place without parsing
+struct LineDocumentHeader
+{
+	char magic[8];					// "LINEDOC\0"
+	unsigned int version;			// kLineDocumentVersion, readers reject newer ones
+	unsigned int record_size;		// sizeof(Line)
+	unsigned long long line_count;
+	unsigned long long records_offset;	// From the start of the file, 64 byte aligned
+	unsigned long long save_id;		// Different for every save, ties snapshots to it
+	unsigned char reserved[24];
+};
+static_assert(sizeof(LineDocumentHeader) == 64, "Line document header is 64 bytes");
+
+static const unsigned int kLineDocumentVersion = 1u;
+
+// Read only mapping of a line document
+class LineDocument
+{
+public:
+	~LineDocument() { close(); }
+
+	bool open(const char* path);
+	void close();
+	bool is_open() const { return mFile.is_open(); }
+	const char* path() const { return mPath; }
+	unsigned long long save_id() const { return mSaveId; }
+
+	const Line* lines() const { return mLines; }
+	size_t line_count() const { return mLineCount; }
+
+	// Writes the lines that are not removed, in order. Goes through a temporary file so
+	// a failed save leaves the old document intact
+	static bool save(const char* path, const LineStore& lines, unsigned long long& save_id);
+
+private:
+	MappedFile mFile;
+	const Line* mLines = nullptr;
+	unsigned long long mSaveId = 0u;
+	size_t mLineCount = 0u;
+	char mPath[260] = {};
+};
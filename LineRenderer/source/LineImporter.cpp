@@ -0,0 +1,343 @@
+#include "LineImporter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Coordinates and radii further out than this are skipped. Floats stop resolving whole
+// pixels past it, and it keeps tile coordinates far inside the canvas's 28-bit tile keys
+static const float kMaxCoordinate = 16777216.0f;
+
+// Powers of ten that are exact as doubles
+static const double kPowersOfTen[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+static bool is_separator(char c)
+{
+	return c == ',' || c == '\t' || c == ';' || c == ' ' || c == '\r';
+}
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static const char* skip_separators(const char* p, const char* end)
+{
+	while (p < end && is_separator(*p))
+		++p;
+	return p;
+}
+
+// Decimal number up to the next separator, nullptr if the field is anything else. The
+// digits are gathered into an integer and scaled by one exact power of ten, which is
+// correctly rounded whenever both fit a double. strtod handles the rest
+static const char* parse_float(const char* p, const char* end, float& value)
+{
+	const char* begin = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	unsigned long long mantissa = 0u;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	for (; p < end && is_digit(*p); ++p, any = true)
+	{
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10u + (*p - '0');
+			digits += mantissa != 0u;
+		}
+		else
+			++exponent;
+	}
+	if (p < end && *p == '.')
+	{
+		for (++p; p < end && is_digit(*p); ++p, any = true)
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10u + (*p - '0');
+				digits += mantissa != 0u;
+				--exponent;
+			}
+		}
+	}
+	if (!any)
+		return nullptr;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool exponent_negative = false;
+		if (q < end && (*q == '-' || *q == '+'))
+			exponent_negative = *q++ == '-';
+		int value_exponent = 0;
+		bool exponent_digits = false;
+		for (; q < end && is_digit(*q); ++q, exponent_digits = true)
+			if (value_exponent < 10000)
+				value_exponent = value_exponent * 10 + (*q - '0');
+		if (exponent_digits)
+		{
+			exponent += exponent_negative ? -value_exponent : value_exponent;
+			p = q;
+		}
+	}
+	if (p < end && !is_separator(*p))
+		return nullptr;
+
+	double result;
+	if (mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22)
+	{
+		result = exponent < 0 ? mantissa / kPowersOfTen[-exponent] : mantissa * kPowersOfTen[exponent];
+	}
+	else
+	{
+		char buffer[64];
+		size_t length = static_cast<size_t>(p - begin);
+		if (length >= sizeof(buffer))
+			return nullptr;
+		memcpy(buffer, begin, length);
+		buffer[length] = '\0';
+		result = strtod(buffer, nullptr);
+		negative = false;
+	}
+	value = static_cast<float>(negative ? -result : result);
+	return p;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// #rrggbb, 0x hexadecimal or decimal, the last two already packed like Line::color
+static bool parse_color(const char* p, const char* end, unsigned int& color)
+{
+	unsigned int value = 0u;
+	if (*p == '#')
+	{
+		if (end - p < 7)
+			return false;
+		for (int i = 1; i <= 6; ++i)
+		{
+			int digit = hex_digit(p[i]);
+			if (digit < 0)
+				return false;
+			value = (value << 4) | static_cast<unsigned int>(digit);
+		}
+		color = ((value >> 16) & 0xffu) | (value & 0xff00u) | ((value & 0xffu) << 16);
+		return true;
+	}
+
+	bool any = false;
+	if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+	{
+		for (p += 2; p < end && hex_digit(*p) >= 0; ++p, any = true)
+			value = (value << 4) | static_cast<unsigned int>(hex_digit(*p));
+	}
+	else
+	{
+		for (; p < end && is_digit(*p); ++p, any = true)
+			value = value * 10u + static_cast<unsigned int>(*p - '0');
+	}
+	if (!any)
+		return false;
+	color = value;
+	return true;
+}
+
+bool LineImporter::start(const char* path, unsigned int default_color)
+{
+	cancel();
+	mFile = fopen(path, "rb");
+	if (!mFile)
+	{
+		fprintf(stdout, "Could not open %s for import.\n", path);
+		return false;
+	}
+
+	mDefaultColor = default_color;
+	mNextRead = mNextParse = mNextConsume = 0u;
+	mReadDone = mCancel = false;
+	mRowsSkipped = 0u;
+
+	// One core is left to the render thread
+	unsigned int workers = std::thread::hardware_concurrency();
+	workers = workers > 1u ? workers - 1u : 1u;
+	workers = workers < kMaxChunksInFlight ? workers : static_cast<unsigned int>(kMaxChunksInFlight);
+	mReader = std::thread(&LineImporter::read, this);
+	for (unsigned int i = 0u; i < workers; ++i)
+		mWorkers.emplace_back(&LineImporter::parse, this);
+	return true;
+}
+
+void LineImporter::cancel()
+{
+	if (!is_active())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mCancel = true;
+	}
+	mChunkRead.notify_all();
+	mChunkDone.notify_all();
+	mReader.join();
+	for (std::thread& worker : mWorkers)
+		worker.join();
+	mWorkers.clear();
+	mChunks.clear();
+	fclose(mFile);
+	mFile = nullptr;
+}
+
+bool LineImporter::poll(std::vector<Line>& lines, size_t max_lines)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	bool consumed = false;
+	while (lines.size() < max_lines)
+	{
+		auto it = mChunks.find(mNextConsume);
+		if (it == mChunks.end() || !it->second.parsed)
+			break;
+
+		Chunk& chunk = it->second;
+		size_t count = chunk.lines.size() - chunk.next_line;
+		count = count < max_lines - lines.size() ? count : max_lines - lines.size();
+		lines.insert(lines.end(), chunk.lines.begin() + chunk.next_line, chunk.lines.begin() + chunk.next_line + count);
+		chunk.next_line += count;
+		if (chunk.next_line < chunk.lines.size())
+			break;
+
+		mRowsSkipped += chunk.rows_skipped;
+		mChunks.erase(it);
+		++mNextConsume;
+		consumed = true;
+	}
+	if (consumed)
+		mChunkDone.notify_one();
+	return !mReadDone || mNextConsume < mNextRead;
+}
+
+void LineImporter::read()
+{
+	std::vector<char> carry;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mChunkDone.wait(lock, [this]() { return mCancel || mNextRead - mNextConsume < kMaxChunksInFlight; });
+			if (mCancel)
+				return;
+		}
+
+		std::vector<char> text;
+		text.reserve(carry.size() + kChunkSize);
+		text.assign(carry.begin(), carry.end());
+		text.resize(carry.size() + kChunkSize);
+		size_t read = fread(text.data() + carry.size(), 1u, kChunkSize, mFile);
+		text.resize(carry.size() + read);
+		bool end = read < kChunkSize;
+
+		// The row cut off at the end goes with the next chunk, unless it fills this one
+		carry.clear();
+		if (!end)
+		{
+			size_t row_end = text.size();
+			while (row_end > 0u && text[row_end - 1u] != '\n')
+				--row_end;
+			if (row_end > 0u)
+			{
+				carry.assign(text.begin() + row_end, text.end());
+				text.resize(row_end);
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (!text.empty())
+				mChunks[mNextRead++].text.swap(text);
+			mReadDone = end;
+		}
+		mChunkRead.notify_all();
+		if (end)
+			return;
+	}
+}
+
+void LineImporter::parse()
+{
+	for (;;)
+	{
+		Chunk* chunk = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mChunkRead.wait(lock, [this]() { return mCancel || mReadDone || mNextParse < mNextRead; });
+			if (mCancel || mNextParse == mNextRead)
+				return;
+			chunk = &mChunks[mNextParse++];
+		}
+
+		// Map nodes stay put, and the chunk is only erased once parsed
+		parse_chunk(*chunk);
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		chunk->parsed = true;
+		std::vector<char>().swap(chunk->text);
+	}
+}
+
+void LineImporter::parse_chunk(Chunk& chunk) const
+{
+	const char* p = chunk.text.data();
+	const char* end = p + chunk.text.size();
+	while (p < end)
+	{
+		const char* row_end = static_cast<const char*>(memchr(p, '\n', end - p));
+		row_end = row_end ? row_end : end;
+		const char* field = skip_separators(p, row_end);
+		p = row_end + 1;
+		if (field == row_end)
+			continue;
+
+		float values[5];
+		int count = 0;
+		while (count < 5 && field < row_end)
+		{
+			const char* next = parse_float(field, row_end, values[count]);
+			if (!next)
+				break;
+			++count;
+			field = skip_separators(next, row_end);
+		}
+		// NaN and infinity fail the comparison too
+		bool in_range = count >= 4;
+		for (int i = 0; i < count && in_range; ++i)
+			in_range = values[i] >= -kMaxCoordinate && values[i] <= kMaxCoordinate;
+		if (!in_range)
+		{
+			++chunk.rows_skipped;
+			continue;
+		}
+
+		Line line;
+		line.start_x = values[0];
+		line.start_y = values[1];
+		line.end_x = values[2];
+		line.end_y = values[3];
+		line.radius = count > 4 && values[4] > 0.0f ? values[4] : 0.0f;
+		line.color = mDefaultColor;
+		if (count > 4 && field < row_end)
+			parse_color(field, row_end, line.color);
+		chunk.lines.push_back(line);
+	}
+}
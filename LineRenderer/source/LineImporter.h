@@ -0,0 +1,72 @@
+#pragma once
+
+#include "LineStore.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Streams lines out of a CSV/TSV text file. A reader thread cuts the file into chunks
+// at row boundaries and worker threads parse them, while the consumer takes the lines
+// in file order. At most kMaxChunksInFlight chunks exist at once, so memory stays the
+// same whatever the file size.
+//
+// Each row is start_x, start_y, end_x, end_y, then optionally radius and color, split
+// by commas, tabs, semicolons or spaces. Color is #rrggbb or an integer packed like
+// Line::color. Rows that don't start with four numbers, e.g. headers, are skipped, and
+// so are rows with a value past 2^24 pixels or that isn't finite
+class LineImporter
+{
+public:
+	static const size_t kChunkSize = 1u << 20;	// Bytes of text per chunk
+	static const size_t kMaxChunksInFlight = 8u;
+
+	~LineImporter() { cancel(); }
+
+	bool start(const char* path, unsigned int default_color);
+	// Stops the threads and drops whatever wasn't taken yet
+	void cancel();
+	bool is_active() const { return mReader.joinable(); }
+
+	// Appends up to max_lines parsed lines without waiting for the workers. Returns false
+	// once every line of the file has been handed out
+	bool poll(std::vector<Line>& lines, size_t max_lines);
+
+	size_t rows_skipped() const { return mRowsSkipped; }
+
+private:
+	struct Chunk
+	{
+		std::vector<char> text;
+		std::vector<Line> lines;
+		size_t rows_skipped = 0u;
+		size_t next_line = 0u;	// First line not handed out yet
+		bool parsed = false;
+	};
+
+	void read();
+	void parse();
+	void parse_chunk(Chunk& chunk) const;
+
+	FILE* mFile = nullptr;
+	unsigned int mDefaultColor = 0u;
+	std::thread mReader;
+	std::vector<std::thread> mWorkers;
+
+	// Chunks by sequence number, from the one being consumed to the last one read
+	std::mutex mMutex;
+	std::condition_variable mChunkRead;
+	std::condition_variable mChunkDone;
+	std::map<size_t, Chunk> mChunks;
+	size_t mNextRead = 0u;		// Sequence number of the next chunk read
+	size_t mNextParse = 0u;		// Lowest sequence number not picked up by a worker
+	size_t mNextConsume = 0u;
+	bool mReadDone = false;
+	bool mCancel = false;
+
+	size_t mRowsSkipped = 0u;
+};
@@ -0,0 +1,388 @@
+#include "LineJournal.h"
+#include "MappedFile.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+static const char kLineJournalMagic[8] = { 'L', 'I', 'N', 'E', 'J', 'R', 'N', 'L' };
+
+// Frame prefix, payload size then hash
+static const size_t kFramePrefix = 8u;
+
+// Add record flags above the two type bits
+static const unsigned char kIntegralStartX = 1u << 2;
+static const unsigned char kIntegralStartY = 1u << 3;
+static const unsigned char kIntegralEndX = 1u << 4;
+static const unsigned char kIntegralEndY = 1u << 5;
+static const unsigned char kSameRadius = 1u << 6;
+static const unsigned char kSameColor = 1u << 7;
+
+namespace
+{
+	unsigned int fnv1a(const unsigned char* data, size_t size)
+	{
+		unsigned int hash = 2166136261u;
+		for (size_t i = 0u; i < size; ++i)
+			hash = (hash ^ data[i]) * 16777619u;
+		return hash;
+	}
+
+	// Integers a float holds exactly, well inside what the deltas can take
+	bool is_integral(float value) { return fabsf(value) < 1073741824.0f && value == floorf(value); }
+	long long reference(float value) { return fabsf(value) < 1073741824.0f ? static_cast<long long>(floorf(value)) : 0; }
+
+	void put_varint(std::vector<unsigned char>& out, unsigned long long value)
+	{
+		while (value >= 0x80u)
+		{
+			out.push_back(static_cast<unsigned char>(value | 0x80u));
+			value >>= 7;
+		}
+		out.push_back(static_cast<unsigned char>(value));
+	}
+
+	void put_signed(std::vector<unsigned char>& out, long long value)
+	{
+		put_varint(out, (static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63));
+	}
+
+	void put_raw(std::vector<unsigned char>& out, const void* value)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(value);
+		out.insert(out.end(), bytes, bytes + 4);
+	}
+
+	void put_coordinate(std::vector<unsigned char>& out, float value, float base, bool integral)
+	{
+		if (integral)
+			put_signed(out, static_cast<long long>(value) - reference(base));
+		else
+			put_raw(out, &value);
+	}
+
+	// Decoding side, false once the payload runs out or a varint is too long
+	struct Cursor
+	{
+		const unsigned char* data;
+		const unsigned char* end;
+
+		bool varint(unsigned long long& value)
+		{
+			value = 0u;
+			for (int shift = 0; shift < 64 && data < end; shift += 7)
+			{
+				unsigned char byte = *data++;
+				value |= static_cast<unsigned long long>(byte & 0x7fu) << shift;
+				if (!(byte & 0x80u))
+					return true;
+			}
+			return false;
+		}
+
+		bool signed_varint(long long& value)
+		{
+			unsigned long long zigzag;
+			if (!varint(zigzag))
+				return false;
+			value = static_cast<long long>(zigzag >> 1) ^ -static_cast<long long>(zigzag & 1u);
+			return true;
+		}
+
+		bool raw(void* value)
+		{
+			if (end - data < 4)
+				return false;
+			memcpy(value, data, 4u);
+			data += 4;
+			return true;
+		}
+
+		bool coordinate(float& value, float base, bool integral)
+		{
+			long long delta;
+			if (!integral)
+				return raw(&value);
+			if (!signed_varint(delta))
+				return false;
+			value = static_cast<float>(reference(base) + delta);
+			return true;
+		}
+	};
+}
+
+bool LineJournal::open(const char* path, unsigned long long save_id, size_t keep_bytes)
+{
+	close();
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, keep_bytes > 0u ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stdout, "Could not open journal %s, edits are not protected.\n", path);
+		return false;
+	}
+	mFile = file;
+	mFailed = false;
+
+	// A torn frame at the end goes, new frames start where the complete ones stop
+	bool ready;
+	if (keep_bytes > 0u)
+	{
+		LARGE_INTEGER position;
+		position.QuadPart = static_cast<LONGLONG>(keep_bytes);
+		ready = SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	}
+	else
+	{
+		LineJournalHeader header = {};
+		memcpy(header.magic, kLineJournalMagic, sizeof(kLineJournalMagic));
+		header.version = kLineJournalVersion;
+		header.save_id = save_id;
+		ready = write(&header, sizeof(header)) && FlushFileBuffers(file);
+	}
+	if (!ready)
+	{
+		fprintf(stdout, "Could not prepare journal %s, edits are not protected.\n", path);
+		CloseHandle(file);
+		mFile = nullptr;
+		return false;
+	}
+
+	mPending.clear();
+	mAppended = mDurable = 0u;
+	mFlushNow = mStop = false;
+	mLastX = mLastY = mLastRadius = 0.0f;
+	mLastColor = 0u;
+	mLastId = 0u;
+	mWriter = std::thread(&LineJournal::write_loop, this);
+	return true;
+}
+
+void LineJournal::close()
+{
+	if (!mFile)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mWake.notify_one();
+	mWriter.join();
+	CloseHandle(mFile);
+	mFile = nullptr;
+}
+
+void LineJournal::append_add(const Line& line)
+{
+	if (!mFile)
+		return;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	bool first = begin_record();
+	bool start_x = is_integral(line.start_x), start_y = is_integral(line.start_y);
+	bool end_x = is_integral(line.end_x), end_y = is_integral(line.end_y);
+	unsigned char tag = static_cast<unsigned char>(JournalRecord::Type::Add) |
+		(start_x ? kIntegralStartX : 0u) | (start_y ? kIntegralStartY : 0u) |
+		(end_x ? kIntegralEndX : 0u) | (end_y ? kIntegralEndY : 0u) |
+		(line.radius == mLastRadius ? kSameRadius : 0u) | (line.color == mLastColor ? kSameColor : 0u);
+	mPending.push_back(tag);
+	put_coordinate(mPending, line.start_x, mLastX, start_x);
+	put_coordinate(mPending, line.start_y, mLastY, start_y);
+	put_coordinate(mPending, line.end_x, line.start_x, end_x);
+	put_coordinate(mPending, line.end_y, line.start_y, end_y);
+	if (!(tag & kSameRadius))
+		put_raw(mPending, &line.radius);
+	if (!(tag & kSameColor))
+		put_raw(mPending, &line.color);
+	mLastX = line.end_x;
+	mLastY = line.end_y;
+	mLastRadius = line.radius;
+	mLastColor = line.color;
+	end_record(first);
+}
+
+void LineJournal::append_remove(size_t id)
+{
+	if (!mFile)
+		return;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	bool first = begin_record();
+	mPending.push_back(static_cast<unsigned char>(JournalRecord::Type::Remove));
+	put_signed(mPending, static_cast<long long>(id) - static_cast<long long>(mLastId));
+	mLastId = id;
+	end_record(first);
+}
+
+void LineJournal::append_restore(size_t id)
+{
+	if (!mFile)
+		return;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	bool first = begin_record();
+	mPending.push_back(static_cast<unsigned char>(JournalRecord::Type::Restore));
+	put_signed(mPending, static_cast<long long>(id) - static_cast<long long>(mLastId));
+	mLastId = id;
+	end_record(first);
+}
+
+bool LineJournal::begin_record()
+{
+	// Room for the frame prefix the writer fills in
+	if (!mPending.empty())
+		return false;
+	mPending.resize(kFramePrefix);
+	return true;
+}
+
+void LineJournal::end_record(bool first)
+{
+	// The writer only needs waking for the first record of a frame or a full one, the
+	// others join the frame it is already gathering
+	++mAppended;
+	if (first || mPending.size() >= kMaxFrameBytes)
+		mWake.notify_one();
+}
+
+void LineJournal::flush()
+{
+	if (!mFile)
+		return;
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	unsigned long long target = mAppended;
+	mFlushNow = true;
+	mWake.notify_one();
+	mWritten.wait(lock, [this, target]() { return mDurable >= target; });
+}
+
+void LineJournal::write_loop()
+{
+	std::vector<unsigned char> frame;
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mWake.wait(lock, [this]() { return mStop || !mPending.empty(); });
+		if (mPending.empty())
+			return;
+
+		// Commits over the next few milliseconds join this frame and share its flush
+		mWake.wait_for(lock, std::chrono::milliseconds(kGroupCommitMs), [this]() { return mStop || mFlushNow || mPending.size() >= kMaxFrameBytes; });
+		frame.swap(mPending);
+		unsigned long long records = mAppended;
+		mFlushNow = false;
+		mLastX = mLastY = mLastRadius = 0.0f;
+		mLastColor = 0u;
+		mLastId = 0u;
+		lock.unlock();
+
+		unsigned int size = static_cast<unsigned int>(frame.size() - kFramePrefix);
+		unsigned int hash = fnv1a(frame.data() + kFramePrefix, size);
+		memcpy(frame.data(), &size, 4u);
+		memcpy(frame.data() + 4, &hash, 4u);
+		if (!(write(frame.data(), frame.size()) && FlushFileBuffers(mFile)) && !mFailed)
+		{
+			fprintf(stdout, "Journal write failed, later edits are not protected.\n");
+			mFailed = true;
+		}
+		frame.clear();
+
+		lock.lock();
+		mDurable = records;
+		mWritten.notify_all();
+	}
+}
+
+bool LineJournal::write(const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0u)
+	{
+		DWORD chunk = size > 0x40000000u ? 0x40000000u : static_cast<DWORD>(size), written = 0u;
+		if (!WriteFile(mFile, bytes, chunk, &written, NULL) || written == 0u)
+			return false;
+		bytes += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool LineJournal::read_save_id(const char* path, unsigned long long& save_id)
+{
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(LineJournalHeader))
+		return false;
+	const LineJournalHeader* header = reinterpret_cast<const LineJournalHeader*>(file.data());
+	if (memcmp(header->magic, kLineJournalMagic, sizeof(kLineJournalMagic)) != 0 || header->version > kLineJournalVersion)
+		return false;
+	save_id = header->save_id;
+	return true;
+}
+
+size_t LineJournal::replay(const char* path, unsigned long long save_id, const std::function<void(const JournalRecord&)>& apply)
+{
+	unsigned long long journal_save_id;
+	if (!read_save_id(path, journal_save_id) || journal_save_id != save_id)
+		return 0u;
+	MappedFile file;
+	if (!file.open(path))
+		return 0u;
+
+	// Frames are decoded in full before any of their records are applied
+	std::vector<JournalRecord> records;
+	size_t offset = sizeof(LineJournalHeader);
+	while (file.size() - offset >= kFramePrefix)
+	{
+		unsigned int size, hash;
+		memcpy(&size, file.data() + offset, 4u);
+		memcpy(&hash, file.data() + offset + 4, 4u);
+		const unsigned char* payload = file.data() + offset + kFramePrefix;
+		if (size > file.size() - offset - kFramePrefix || fnv1a(payload, size) != hash)
+			break;
+
+		records.clear();
+		Cursor cursor = { payload, payload + size };
+		JournalRecord previous = {};
+		bool valid = true;
+		while (valid && cursor.data < cursor.end)
+		{
+			unsigned char tag = *cursor.data++;
+			JournalRecord record = {};
+			record.type = static_cast<JournalRecord::Type>(tag & 3u);
+			if (record.type == JournalRecord::Type::Add)
+			{
+				Line& line = record.line;
+				valid = cursor.coordinate(line.start_x, previous.line.end_x, (tag & kIntegralStartX) != 0u) &&
+					cursor.coordinate(line.start_y, previous.line.end_y, (tag & kIntegralStartY) != 0u) &&
+					cursor.coordinate(line.end_x, line.start_x, (tag & kIntegralEndX) != 0u) &&
+					cursor.coordinate(line.end_y, line.start_y, (tag & kIntegralEndY) != 0u);
+				line.radius = previous.line.radius;
+				line.color = previous.line.color;
+				valid = valid && ((tag & kSameRadius) || cursor.raw(&line.radius)) && ((tag & kSameColor) || cursor.raw(&line.color));
+				previous.line = line;
+			}
+			else if (record.type == JournalRecord::Type::Remove || record.type == JournalRecord::Type::Restore)
+			{
+				long long delta = 0;
+				valid = cursor.signed_varint(delta) && static_cast<long long>(previous.id) + delta >= 0;
+				record.id = previous.id = static_cast<size_t>(static_cast<long long>(previous.id) + delta);
+			}
+			else
+			{
+				valid = false;
+			}
+			records.push_back(record);
+		}
+		if (!valid)
+			break;
+
+		for (const JournalRecord& record : records)
+			apply(record);
+		offset += kFramePrefix + size;
+	}
+	return offset;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "LineStore.h"
+
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Journal file layout, little endian: this header, then frames of a 4 byte payload size,
+// the payload's 32-bit FNV-1a hash and the payload, a run of records
+struct LineJournalHeader
+{
+	char magic[8];				// "LINEJRNL"
+	unsigned int version;		// kLineJournalVersion, readers reject newer ones
+	unsigned int reserved0;
+	unsigned long long save_id;	// Document save the edits apply on top of, 0 for none
+	unsigned char reserved[8];
+};
+static_assert(sizeof(LineJournalHeader) == 32, "Line journal header is 32 bytes");
+
+static const unsigned int kLineJournalVersion = 1u;
+
+// Edit of the line model as the journal replays it. Ids count the document's lines
+// first and then every line the journal added, in order
+struct JournalRecord
+{
+	enum class Type
+	{
+		Add = 1,
+		Remove = 2,
+		Restore = 3
+	};
+
+	Type type;
+	Line line;	// Add only
+	size_t id;	// Remove and restore only
+};
+
+// Append-only log of the line edits made since a document save, so a session that dies
+// only loses the last group commit window. Appending encodes the record into a buffer
+// under a lock. A writer thread takes whatever gathered over kGroupCommitMs, writes it
+// as one checksummed frame and flushes it to disk, so one flush covers many commits.
+//
+// Records are a type byte and varints: integral coordinates are zigzag deltas from the
+// line before (the end point from the start point), repeated radius and color are a flag
+// bit. Delta state starts over with every frame, so frames decode on their own and a
+// torn last frame is just where replay stops
+class LineJournal
+{
+public:
+	static const int kGroupCommitMs = 20;
+	static const size_t kMaxFrameBytes = 256u << 10;	// Frame written early once this full
+
+	~LineJournal() { close(); }
+
+	// Journals on top of a document save, 0 for a drawing never saved. The first
+	// keep_bytes of an existing journal for the same save stay, as returned by replay,
+	// anything else in the file is dropped
+	bool open(const char* path, unsigned long long save_id, size_t keep_bytes);
+	// Everything appended is on disk before it returns
+	void close();
+	bool is_open() const { return mFile != nullptr; }
+
+	void append_add(const Line& line);
+	void append_remove(size_t id);
+	void append_restore(size_t id);
+	// Blocks until everything appended so far is on disk
+	void flush();
+
+	// Save the journal continues from, false without a readable journal
+	static bool read_save_id(const char* path, unsigned long long& save_id);
+	// Runs apply on every record of complete frames. Returns the bytes those take up, 0
+	// when the journal is missing or continues from another save
+	static size_t replay(const char* path, unsigned long long save_id, const std::function<void(const JournalRecord&)>& apply);
+
+private:
+	bool begin_record();
+	void end_record(bool first);
+	void write_loop();
+	bool write(const void* data, size_t size);
+
+	void* mFile = nullptr;	// Windows handle
+	std::thread mWriter;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mWritten;
+	std::vector<unsigned char> mPending;	// Frame payload being gathered
+	unsigned long long mAppended = 0u;		// Records appended, and how many are on disk
+	unsigned long long mDurable = 0u;
+	bool mFlushNow = false;
+	bool mStop = false;
+	bool mFailed = false;
+
+	// Delta state of the frame being gathered
+	float mLastX = 0.0f;
+	float mLastY = 0.0f;
+	float mLastRadius = 0.0f;
+	unsigned int mLastColor = 0u;
+	size_t mLastId = 0u;
+};
@@ -0,0 +1,171 @@
+#include "LineStore.h"
+
+#include <math.h>
+
+static const float kOriginTileSize = 256.0f;	// Block origins are on the canvas tile grid
+static const size_t kDecodeChunk = 4096u;		// Compact lines decoded per contiguous() call
+
+// Round to nearest even, magnitudes past the largest half become infinity
+static unsigned short float_to_half(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	unsigned int sign = (bits >> 16) & 0x8000u;
+	unsigned int magnitude = bits & 0x7fffffffu;
+	if (magnitude >= 0x7f800000u)
+		return static_cast<unsigned short>(sign | 0x7c00u | (magnitude > 0x7f800000u ? 0x200u : 0u));
+	if (magnitude >= 0x477ff000u)
+		return static_cast<unsigned short>(sign | 0x7c00u);
+	if (magnitude < 0x38800000u)
+	{
+		// Subnormal, a multiple of 2^-24
+		float absolute;
+		memcpy(&absolute, &magnitude, sizeof(absolute));
+		return static_cast<unsigned short>(sign | static_cast<unsigned int>(nearbyintf(absolute * 16777216.0f)));
+	}
+	unsigned int rounded = magnitude + 0xfffu + ((magnitude >> 13) & 1u);
+	return static_cast<unsigned short>(sign | ((rounded - 0x38000000u) >> 13));
+}
+
+// Offset from origin in 1/steps pixel steps, false when it doesn't fit in 16 bits or,
+// with exact set, falls between two steps
+static bool to_fixed(float value, float origin, double steps, bool exact, short& fixed)
+{
+	double offset = (static_cast<double>(value) - origin) * steps;
+	double rounded = floor(offset + 0.5);
+	if (!(rounded >= -32768.0 && rounded <= 32767.0) || (exact && rounded != offset))
+		return false;
+	fixed = static_cast<short>(rounded);
+	return true;
+}
+
+static bool to_fixed(const Line& line, const float origin_x, const float origin_y, double steps, bool exact, CompactLine& compact)
+{
+	return to_fixed(line.start_x, origin_x, steps, exact, compact.start_x) && to_fixed(line.start_y, origin_y, steps, exact, compact.start_y) &&
+		to_fixed(line.end_x, origin_x, steps, exact, compact.end_x) && to_fixed(line.end_y, origin_y, steps, exact, compact.end_y);
+}
+
+void LineStore::add_compact(const Line& line, bool exact)
+{
+	size_t index = mCompact.size();
+	if (index % kBlockLines == 0u)
+	{
+		Block block = { 0.0f, 0.0f, static_cast<unsigned int>(mPalette.size()) };
+		if (fabsf(line.start_x) < 1e9f && fabsf(line.start_y) < 1e9f)
+		{
+			block.origin_x = floorf(line.start_x / kOriginTileSize) * kOriginTileSize;
+			block.origin_y = floorf(line.start_y / kOriginTileSize) * kOriginTileSize;
+		}
+		mBlocks.push_back(block);
+	}
+	const Block& block = mBlocks[index / kBlockLines];
+
+	// Sixteenth pixel steps near the origin, whole pixels further out for integral lines
+	CompactLine compact;
+	compact.flags = 0u;
+	bool fits = fabsf(line.radius) < 65504.0f;
+	if (fits && !to_fixed(line, block.origin_x, block.origin_y, 16.0, exact, compact))
+	{
+		compact.flags = kIntegral;
+		fits = to_fixed(line, block.origin_x, block.origin_y, 1.0, true, compact);
+	}
+	if (fits)
+	{
+		// A block has at most kBlockLines colors, the most recent one is the likeliest
+		size_t color = mPalette.size();
+		while (color > block.palette && mPalette[color - 1u] != line.color)
+			--color;
+		if (color == block.palette)
+		{
+			mPalette.push_back(line.color);
+			color = mPalette.size();
+		}
+		compact.color = static_cast<unsigned char>(color - 1u - block.palette);
+		compact.radius = float_to_half(line.radius);
+		mCompact.push_back(compact);
+		Line decoded = decode(index);
+		if (!exact || memcmp(&decoded, &line, sizeof(Line)) == 0)
+			return;
+		mCompact.pop_back();
+	}
+
+	// Kept whole, the record holds where
+	size_t full = mFull.size();
+	mFull.push_back(line);
+	compact.start_x = static_cast<short>(full & 0xffffu);
+	compact.start_y = static_cast<short>((full >> 16) & 0xffffu);
+	compact.end_x = compact.end_y = 0;
+	compact.radius = 0u;
+	compact.color = 0u;
+	compact.flags = kFullRecord;
+	mCompact.push_back(compact);
+}
+
+size_t LineStore::memory_usage() const
+{
+	size_t bytes = mLines.capacity() * sizeof(Line) + mRemoved.capacity() / 8u;
+	bytes += mCompact.capacity() * sizeof(CompactLine) + mBlocks.capacity() * sizeof(Block);
+	bytes += mPalette.capacity() * sizeof(unsigned int) + mFull.capacity() * sizeof(Line);
+	return bytes;
+}
+
+const Line* LineStore::contiguous(size_t id, size_t& count, std::vector<Line>& scratch) const
+{
+	if (id < mAttachedCount)
+	{
+		count = mAttachedCount - id;
+		return mAttached + id;
+	}
+	count = size() - id;
+	if (count == 0u)
+		return nullptr;
+	size_t index = id - mAttachedCount;
+	if (!mCompactMode)
+		return &mLines[index];
+
+	count = count < kDecodeChunk ? count : kDecodeChunk;
+	scratch.resize(count);
+	for (size_t i = 0u; i < count; ++i)
+		scratch[i] = decode(index + i);
+	return scratch.data();
+}
+
+void LineStore::detach()
+{
+	if (!mCompactMode)
+	{
+		mLines.insert(mLines.begin(), mAttached, mAttached + mAttachedCount);
+		mAttached = nullptr;
+		mAttachedCount = 0u;
+		return;
+	}
+
+	// Blocks count from the first owned line, so every line is encoded again. Lines
+	// decoded encode to themselves, attached ones that would round are kept whole as
+	// the index and the canvas already have them
+	std::vector<Line> lines(size());
+	for (size_t id = 0u; id < lines.size(); ++id)
+		lines[id] = get(id);
+	mAttached = nullptr;
+	mAttachedCount = 0u;
+	mCompact.clear();
+	mBlocks.clear();
+	mPalette.clear();
+	mFull.clear();
+	mCompact.reserve(lines.size());
+	for (const Line& line : lines)
+		add_compact(line, true);
+}
+
+void LineStore::clear()
+{
+	mLines.clear();
+	mRemoved.clear();
+	mRemovedCount = 0u;
+	mAttached = nullptr;
+	mAttachedCount = 0u;
+	mCompact.clear();
+	mBlocks.clear();
+	mPalette.clear();
+	mFull.clear();
+}
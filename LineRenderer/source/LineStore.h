@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+// Committed line as stored in the vector model, all positions in canvas pixels. The
+// layout is also the record format of line documents and the GPU line buffer
+struct Line
+{
+	float start_x;
+	float start_y;
+	float end_x;
+	float end_y;
+	float radius;		// SDF radius in pixels, 0 for single pixel lines
+	unsigned int color;	// RGBA8, red in the lowest byte
+};
+static_assert(sizeof(Line) == 24, "Line records are 24 bytes on disk and on the GPU");
+
+// Compact form of a line: end points as 16-bit fixed point relative to the tile origin
+// of its block, the radius as a half float and the color as an index into the block's
+// palette. End points within 2048 pixels of the origin are kept in 1/16 pixel steps,
+// integral ones up to 32768 pixels away in whole pixels, so pixel aligned lines come
+// back exactly. Others round to 1/16 pixel, the radius keeps 11 significant bits
+struct CompactLine
+{
+	short start_x;
+	short start_y;
+	short end_x;
+	short end_y;
+	unsigned short radius;
+	unsigned char color;
+	unsigned char flags;	// kIntegral, or kFullRecord for lines kept as a whole Line
+};
+static_assert(sizeof(CompactLine) == 12, "Compact lines are half a Line");
+
+// Every committed line in submission order, indexed by line id. Removed lines keep
+// their slot so ids stay stable and submission order is preserved. The first lines can
+// be records owned elsewhere, such as a mapped document, used in place.
+//
+// In compact mode lines added are kept as CompactLine. Each block of kBlockLines
+// consecutive ids shares a tile origin, taken from the block's first line, and a
+// palette of the colors its lines use. Lines too far from the origin are kept whole
+// on the side
+class LineStore
+{
+public:
+	static const size_t kBlockLines = 256u;
+	static const unsigned char kIntegral = 1u;
+	static const unsigned char kFullRecord = 2u;
+
+	// Only while the store is empty
+	void set_compact(bool compact) { mCompactMode = compact; }
+	bool is_compact() const { return mCompactMode; }
+
+	size_t add(const Line& line)
+	{
+		if (mCompactMode)
+			add_compact(line, false);
+		else
+			mLines.push_back(line);
+		mRemoved.push_back(false);
+		return size() - 1u;
+	}
+	void remove(size_t id)
+	{
+		if (!mRemoved[id])
+			++mRemovedCount;
+		mRemoved[id] = true;
+	}
+	void restore(size_t id)
+	{
+		if (mRemoved[id])
+			--mRemovedCount;
+		mRemoved[id] = false;
+	}
+	// Compact lines come back decoded, so the copy is what was stored
+	Line get(size_t id) const
+	{
+		if (id < mAttachedCount)
+			return mAttached[id];
+		id -= mAttachedCount;
+		return mCompactMode ? decode(id) : mLines[id];
+	}
+	bool is_removed(size_t id) const { return mRemoved[id]; }
+	size_t size() const { return mAttachedCount + (mCompactMode ? mCompact.size() : mLines.size()); }
+	size_t live_count() const { return size() - mRemovedCount; }
+	// Bytes the records and the removed flags take up, attached ones excluded
+	size_t memory_usage() const;
+
+	// Records consecutive in memory from id on, for uploads without a copy. Compact
+	// lines are decoded into scratch a chunk at a time
+	const Line* contiguous(size_t id, size_t& count, std::vector<Line>& scratch) const;
+
+	// Starts over with external records as the first lines, they must outlive the store
+	// or be detached first
+	void attach(const Line* lines, size_t count)
+	{
+		clear();
+		mAttached = lines;
+		mAttachedCount = count;
+		mRemoved.assign(count, false);
+	}
+	// Copies external records in so their owner can go away
+	void detach();
+	// Keeps the mode
+	void clear();
+
+private:
+	struct Block
+	{
+		float origin_x;
+		float origin_y;
+		unsigned int palette;	// First color in mPalette, the last block's colors end it
+	};
+
+	// Exact keeps lines that would round whole
+	void add_compact(const Line& line, bool exact);
+	Line decode(size_t index) const;
+	static float half_to_float(unsigned short half);
+
+	const Line* mAttached = nullptr;
+	size_t mAttachedCount = 0u;
+	std::vector<Line> mLines;
+	std::vector<bool> mRemoved;
+	size_t mRemovedCount = 0u;
+
+	bool mCompactMode = false;
+	std::vector<CompactLine> mCompact;
+	std::vector<Block> mBlocks;
+	std::vector<unsigned int> mPalette;
+	std::vector<Line> mFull;	// Lines that didn't fit, a CompactLine holds the index
+};
+
+inline float LineStore::half_to_float(unsigned short half)
+{
+	unsigned int sign = (half & 0x8000u) << 16;
+	unsigned int exponent = (half >> 10) & 0x1fu;
+	unsigned int mantissa = half & 0x3ffu;
+	unsigned int bits;
+	if (exponent == 0u)
+	{
+		// Zero and subnormals, which are mantissa * 2^-24
+		float value = mantissa * (1.0f / 16777216.0f);
+		return sign ? -value : value;
+	}
+	if (exponent == 31u)
+		bits = sign | 0x7f800000u | (mantissa << 13);
+	else
+		bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline Line LineStore::decode(size_t index) const
+{
+	const CompactLine& compact = mCompact[index];
+	if (compact.flags & kFullRecord)
+		return mFull[static_cast<unsigned short>(compact.start_x) | static_cast<size_t>(static_cast<unsigned short>(compact.start_y)) << 16];
+	const Block& block = mBlocks[index / kBlockLines];
+	const float scale = (compact.flags & kIntegral) ? 1.0f : 1.0f / 16.0f;
+	Line line;
+	line.start_x = block.origin_x + compact.start_x * scale;
+	line.start_y = block.origin_y + compact.start_y * scale;
+	line.end_x = block.origin_x + compact.end_x * scale;
+	line.end_y = block.origin_y + compact.end_y * scale;
+	line.radius = half_to_float(compact.radius);
+	line.color = mPalette[block.palette + compact.color];
+	return line;
+}
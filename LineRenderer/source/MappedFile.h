@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+// Read only view of a whole file, pages are only read in as they are first touched
+class MappedFile
+{
+public:
+	~MappedFile() { close(); }
+
+	bool open(const char* path);
+	void close();
+	bool is_open() const { return mView != nullptr; }
+
+	const unsigned char* data() const { return static_cast<const unsigned char*>(mView); }
+	size_t size() const { return mSize; }
+
+private:
+	// Windows handles, kept opaque so users don't pull in Windows.h
+	void* mFile = nullptr;
+	void* mMapping = nullptr;
+	const void* mView = nullptr;
+	size_t mSize = 0u;
+};
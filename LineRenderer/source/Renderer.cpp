@@ -1,92 +1,1492 @@
 #include "Renderer.h"
+#include "Geometry.h"
+#include "ImageWriter.h"
 
+#include <float.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <random>
 #include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
 
-void Renderer::initialize(int width, int height)
+// Composites timed per mode when picking the fastest one at startup
+static const int kCompositeBenchmarkWarmup = 4;
+static const int kCompositeBenchmarkIterations = 32;
+
+// Lines committed per configuration by run_line_benchmark
+static const int kLineBenchmarkLines = 2000;
+
+// Width in pixels of the smoothed edge of SDF lines
+static const float kSDFFade = 2.56f;
+
+// Zoom limits, zoomed out as far as the coarsest pyramid level allows
+static const float kMinZoom = 1.0f / (1 << (Canvas::kLevelCount - 1));
+static const float kMaxZoom = 64.0f;
+
+// Pyramid tiles downsampled per frame, the rest show stale content until later frames
+static const int kDownsampleBudget = 16;
+
+// Detail tiles kept while zoomed in, and time per frame spent rasterizing them
+static const size_t kMaxDetailTiles = 256u;
+static const double kDetailTimeBudget = 4.0;
+
+// Lines rasterized into a detail tile between checks of the time budget
+static const size_t kDetailLineChunk = 1024u;
+
+// Fewer lines than this are drawn one by one, more go through the instanced programs
+static const size_t kMinBatchLines = 16u;
+
+// Time per frame spent bringing in an opened document, and lines indexed between checks
+static const double kLoadTimeBudget = 8.0;
+static const size_t kLoadLineChunk = 16384u;
+
+// Time per frame spent committing imported lines, and lines committed between checks
+static const double kImportTimeBudget = 6.0;
+static const size_t kImportBatchLines = 16384u;
+
+// Snapshot tiles read back per request, and the tag telling their pieces apart
+static const size_t kSnapshotBatchTiles = 16u;
+static const int kSnapshotReadback = 1;
+
+// Deltas appended before the next snapshot is a full one again
+static const int kMaxSnapshotDeltas = 32;
+
+// Poster chunks are rendered up to this wide, strips are about kPosterStripBytes tall
+// within the row limits, and time per frame spent rendering them
+static const int kPosterChunkWidth = 4096;
+static const size_t kPosterStripBytes = 16u << 20;
+static const int kPosterMinStripRows = 16;
+static const int kPosterMaxStripRows = 256;
+static const int kMaxPosterEdge = 1 << 20;
+static const double kPosterTimeBudget = 6.0;
+
+// Journal id of lines a save dropped
+static const size_t kNotJournaled = ~static_cast<size_t>(0u);
+
+// Creates a framebuffer with a single color attachment, a texture when not multisampled.
+// Resolving needs the same format on both sides, so it follows the canvas
+static GLuint create_color_target(int width, int height, int samples, GLenum format, GLuint& storage)
+{
+	GLuint framebuffer = 0u;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	if (samples > 0)
+	{
+		glGenRenderbuffers(1, &storage);
+		glBindRenderbuffer(GL_RENDERBUFFER, storage);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, storage);
+	}
+	else
+	{
+		glGenTextures(1, &storage);
+		glBindTexture(GL_TEXTURE_2D, storage);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, storage, 0);
+	}
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stdout, "Framebuffer with %d samples failed to complete.\n", samples);
+
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	return framebuffer;
+}
+
+static void delete_color_target(GLuint framebuffer, GLuint storage, int samples)
+{
+	glDeleteFramebuffers(1, &framebuffer);
+	if (samples > 0)
+		glDeleteRenderbuffers(1, &storage);
+	else
+		glDeleteTextures(1, &storage);
+}
+
+void Renderer::initialize(int width, int height, const RendererSettings& settings)
 {
+	mCanvas.set_format(settings.format);
+	mBlendMode = settings.blend;
+	mCompressSnapshots = settings.compress_snapshots;
+	mCaptureFormat = settings.raw_capture ? FrameFormat::Raw : FrameFormat::QOI;
+	mLines.set_compact(settings.compact_lines);
+	fprintf(stdout, "Canvas format %s, %s blending\n", Canvas::format_name(settings.format), settings.blend == BlendMode::Max ? "max" : "over");
+
 	srand(static_cast<unsigned int>(time(0)));
 	assign_random_color();
 
+	mWidth = width;
+	mHeight = height;
 	mHalfWidth = static_cast<float>(width) * 0.5f;
 	mHalfHeight = static_cast<float>(height) * 0.5f;
-	create_framebuffer(width, height);
 	create_buffers();
 	create_shaders();
+	glGenQueries(kMaxFramesInFlight, mFrameQueries);
+	glGetIntegerv(GL_MAX_SAMPLES, &mMaxMsaaSamples);
+	GLint max_texels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+	mMaxBatchLines = static_cast<size_t>(max_texels) / 3u;
+	mIndex.set_margin(kSDFFade + 1.0f);
 
-	// Need to set blending for correct color merge when drawing lines
+	// Lines come out premultiplied, so the same over operator works for every canvas
+	// format and downsampling the pyramid averages correctly. Max ignores the factors,
+	// keeping the brightest premultiplied value per channel whatever the order
 	glEnable(GL_BLEND);
-	glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glBlendEquation(mBlendMode == BlendMode::Max ? GL_MAX : GL_FUNC_ADD);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	select_composite_mode();
+}
+
+void Renderer::resize(int width, int height)
+{
+	// Camera center and zoom stay, the window just shows more or less of the canvas
+	mWidth = width;
+	mHeight = height;
+	mHalfWidth = static_cast<float>(width) * 0.5f;
+	mHalfHeight = static_cast<float>(height) * 0.5f;
+	mBackBufferValid = false;
+}
+
+void Renderer::begin_frame()
+{
+	// Drop frames the GPU already finished, then block until there is a free slot
+	retire_frames(false);
+	mStatsQueueDepth += mFramesInFlight;
+	if (mFramesInFlight > mStatsMaxQueueDepth)
+		mStatsMaxQueueDepth = mFramesInFlight;
+	++mStatsFrames;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	while (mFramesInFlight >= mMaxFramesInFlight)
+		retire_frames(true);
+	std::chrono::duration<double, std::milli> waited = std::chrono::high_resolution_clock::now() - start;
+	mStatsWaitTime += waited.count();
 }
 
 void Renderer::render()
 {
-	// Copy cached lines to back buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, 0u);
-	glUseProgram(mProgramToDisplay);
-	bind_plane();
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, mFramebufferTexture);
-	glUniform1i(glGetUniformLocation(mProgramToDisplay, "image"), 0);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	// Tag the frame with the input it is about to show
+	if (mIsDrawingLine && mHasPendingInput)
+	{
+		mRenderedInputTime = mPendingInputTime;
+		mHasRenderedInput = true;
+	}
+	mHasPendingInput = false;
+
+	// Back buffer still holds the cached lines from the last frame
+	if (mBackBufferPreserved && mBackBufferValid && !mIsDrawingLine)
+		return;
+	++mFrameIndex;
+	mPendingWork = false;
+
+	// Copy cached lines to back buffer, sharpened by detail tiles when zoomed in
+	update_import();
+	update_document_load();
+	update_poster();
+	update_detail_tiles();
+	composite(mCompositeMode);
+	mBackBufferValid = !mIsDrawingLine && !mPendingWork;
 
 	// Render line if we are not yet done
 	if (mIsDrawingLine)
-		render_line();
+	{
+		set_window_target();
+		render_line(current_line());
+	}
+
+	// Window capture sees the frame as it will be presented, tried again next frame when
+	// every readback buffer is taken
+	if (mWindowReadback && mReadback.capture(0u, 0, 0, mWidth, mHeight, ReadbackFormat(), mWindowReadback))
+		mWindowReadback = nullptr;
+	// Recorded frames don't wait for a buffer, the recorder counts them as dropped
+	ReadbackCallback frame;
+	if (mRecorder.is_recording() && mWidth > 0 && mHeight > 0 && mRecorder.begin_frame(frame) &&
+		!mReadback.capture(0u, 0, 0, mWidth, mHeight, ReadbackFormat(), std::move(frame)))
+		mRecorder.cancel_frame();
+	// Tiles that stayed out of sight for a while are compressed a few at a time
+	mCanvas.update_residency();
+}
+
+void Renderer::end_frame()
+{
+	// Called after the swap so the fence covers the whole frame
+	int slot = (mOldestFrame + mFramesInFlight) % kMaxFramesInFlight;
+	mFrameHasInput[slot] = mMeasureLatency && mHasRenderedInput;
+	mFrameInputTimes[slot] = mRenderedInputTime;
+	mHasRenderedInput = false;
+
+	// Timestamp goes before the fence so its result is ready once the fence signals
+	if (mFrameHasInput[slot])
+		glQueryCounter(mFrameQueries[slot], GL_TIMESTAMP);
+	mFrameFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	++mFramesInFlight;
+
+	// Canvas readbacks move along between frames, tiles are looked up as their copy starts
+	mReadback.update([this](const ReadbackPiece& piece, GLuint& framebuffer) { return readback_source(piece, framebuffer); });
+	if (mSnapshotPending.empty() && !mSnapshotPreserved.empty())
+		free_snapshot_tiles();
 }
 
 void Renderer::shutdown()
 {
+	print_frame_stats();
+	mLatency.print_report("Input to GPU");
+	while (mFramesInFlight > 0)
+	{
+		glDeleteSync(mFrameFences[mOldestFrame]);
+		mOldestFrame = (mOldestFrame + 1) % kMaxFramesInFlight;
+		--mFramesInFlight;
+	}
+	glDeleteQueries(kMaxFramesInFlight, mFrameQueries);
+
+	fprintf(stdout, "Canvas: %zu tiles, %zu compressed, %.1f MB\n", mCanvas.tile_count(), mCanvas.compressed_tile_count(), mCanvas.memory_usage() / (1024.0 * 1024.0));
+	fprintf(stdout, "Lines: %zu, %s records %.1f MB, index %.1f MB\n", mIndex.line_count(), mLines.is_compact() ? "compact" : "full",
+		mLines.memory_usage() / (1024.0 * 1024.0), mIndex.memory_usage() / (1024.0 * 1024.0));
+	fprintf(stdout, "Undo snapshots: %.1f MB\n", mHistory.memory_usage() / (1024.0 * 1024.0));
+	// A snapshot still being captured is completed so the file is usable next time
+	while (mSnapshot && !mSnapshot->done && mReadback.is_busy())
+	{
+		glFlush();
+		mReadback.update([this](const ReadbackPiece& piece, GLuint& framebuffer) { return readback_source(piece, framebuffer); });
+	}
+	// A poster export can't finish without frames, the chunks in flight remove its file
+	abort_poster();
+	mReadback.shutdown();
+	mRecorder.stop();
+	reset_drawing();
+
 	glDeleteProgram(mProgramToDisplay);
+	glDeleteProgram(mProgramBatchSDF);
+	glDeleteProgram(mProgramBatchSimple);
+	glDeleteTextures(1, &mLineTexture);
+	glDeleteBuffers(1, &mLineBuffer);
+	glDeleteBuffers(1, &mIdBuffer);
 	glDeleteBuffers(1, &mLine);
 	glDeleteBuffers(1, &mPlane);
-	glDeleteFramebuffers(1, &mFramebuffer);
-	glDeleteTextures(1, &mFramebufferTexture);
 }
 
 void Renderer::end_line(int x, int y)
 {
 	mIsDrawingLine = false;
 
-	// Render finished line to static image so we don't have to compute it every time
-	glBindFramebuffer(GL_FRAMEBUFFER, mFramebuffer);
-	render_line();
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// Keep the line in the vector model and render it to the static image so we
+	// don't have to compute it every time. Compact storage can round it, from here on
+	// it is the stored line that gets drawn
+	size_t id = mLines.add(current_line());
+	const Line line = mLines.get(id);
+	mIndex.insert(id, line);
+	journal_add(id);
+	mRecording = &mHistory.begin(HistoryEntry::Type::Add);
+	mRecording->lines.push_back(id);
+	commit_line(line);
+	mHistory.end();
+	mRecording = nullptr;
+	mBackBufferValid = false;
+
+	// A detail tile being rasterized gets the line at the end of its list
+	if (mJobActive)
+	{
+		float span = Canvas::tile_span(mJobLevel);
+		float origin_x = mJobX * span, origin_y = mJobY * span;
+		float padding = mIndex.reach(line) + ldexpf(1.0f, mJobLevel);
+		if (segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, padding, origin_x, origin_y, origin_x + span, origin_y + span))
+			mJobLines.push_back(id);
+	}
 
 	assign_random_color();
 }
 
-void Renderer::create_framebuffer(int width, int height)
+void Renderer::pan(int dx, int dy)
+{
+	mCameraX -= dx / mZoom;
+	mCameraY -= dy / mZoom;
+	mBackBufferValid = false;
+}
+
+void Renderer::zoom(int x, int y, float factor)
+{
+	// Keep the canvas point under the cursor where it is
+	float canvas_x = mCameraX + x / mZoom;
+	float canvas_y = mCameraY + y / mZoom;
+	mZoom *= factor;
+	mZoom = mZoom < kMinZoom ? kMinZoom : (mZoom > kMaxZoom ? kMaxZoom : mZoom);
+	mCameraX = canvas_x - x / mZoom;
+	mCameraY = canvas_y - y / mZoom;
+	mBackBufferValid = false;
+}
+
+bool Renderer::pick_line(int x, int y, size_t& id)
+{
+	finish_document_index();
+
+	// A few window pixels of slack whatever the zoom
+	float canvas_x = mCameraX + x / mZoom;
+	float canvas_y = mCameraY + y / mZoom;
+	return mIndex.query_nearest(mLines, canvas_x, canvas_y, 4.0f / mZoom, id);
+}
+
+bool Renderer::delete_line(size_t id)
+{
+	finish_document_index();
+	if (id >= mLines.size() || mLines.is_removed(id))
+		return false;
+
+	std::vector<size_t> removed(1u, id);
+	mIndex.remove(id, mLines.get(id));
+	mLines.remove(id);
+	journal_remove(id);
+	mRecording = &mHistory.begin(HistoryEntry::Type::Remove);
+	mRecording->lines = removed;
+	redraw_lines(removed, true);
+	mHistory.end();
+	mRecording = nullptr;
+	mBackBufferValid = false;
+	return true;
+}
+
+void Renderer::erase(int x, int y)
+{
+	finish_document_index();
+
+	// Lines whose capsule the brush circle touches
+	float canvas_x = mCameraX + x / mZoom;
+	float canvas_y = mCameraY + y / mZoom;
+	std::vector<size_t> removed;
+	mIndex.query_region(mLines, canvas_x - mRadius, canvas_y - mRadius, canvas_x + mRadius, canvas_y + mRadius, removed);
+	size_t count = 0u;
+	for (size_t id : removed)
+	{
+		const Line& line = mLines.get(id);
+		float distance = point_segment_distance(canvas_x, canvas_y, line.start_x, line.start_y, line.end_x, line.end_y);
+		if (distance - (line.radius > 0.0f ? line.radius : 0.5f) <= mRadius)
+			removed[count++] = id;
+	}
+	removed.resize(count);
+	if (removed.empty())
+		return;
+
+	for (size_t id : removed)
+	{
+		mIndex.remove(id, mLines.get(id));
+		mLines.remove(id);
+		journal_remove(id);
+	}
+	mRecording = &mHistory.begin(HistoryEntry::Type::Remove);
+	mRecording->lines = removed;
+	redraw_lines(removed, true);
+	mHistory.end();
+	mRecording = nullptr;
+	mBackBufferValid = false;
+}
+
+bool Renderer::undo()
+{
+	finish_document_index();
+	HistoryEntry* entry = mHistory.undo();
+	if (!entry)
+		return false;
+	apply_history(*entry, entry->type == HistoryEntry::Type::Remove);
+	return true;
+}
+
+bool Renderer::redo()
+{
+	finish_document_index();
+	HistoryEntry* entry = mHistory.redo();
+	if (!entry)
+		return false;
+	apply_history(*entry, entry->type == HistoryEntry::Type::Add);
+	return true;
+}
+
+void Renderer::set_undo_budget(size_t bytes)
+{
+	mHistory.set_budget(bytes);
+}
+
+bool Renderer::open_document(const char* path)
+{
+	reset_drawing();
+	if (!mDocument.open(path))
+		return false;
+
+	// The mapped records are the line model as is, indexing and rasterizing them is
+	// spread over the next frames. Edits journaled since the save go on top, the tiles
+	// they touch are rasterized even over a snapshot
+	mLines.attach(mDocument.lines(), mDocument.line_count());
+	std::string journal = std::string(path) + ".journal";
+	size_t journal_bytes = replay_journal(journal.c_str(), mDocument.save_id());
+	mLoading = true;
+	mLoadRasterize = !restore_snapshot((std::string(path) + ".snap").c_str());
+	mLoadLineCount = mLines.size();
+	mLoadNextLine = 0u;
+	mLoadNextTile = 0u;
+	mLoadStart = std::chrono::high_resolution_clock::now();
+	mBackBufferValid = false;
+	mJournal.open(journal.c_str(), mDocument.save_id(), journal_bytes);
+	mJournalLines = mLines.size();
+	fprintf(stdout, "Opened %s, %zu lines\n", path, mDocument.line_count());
+	return true;
+}
+
+bool Renderer::start_session(const char* path)
+{
+	std::string journal = std::string(path) + ".journal";
+	unsigned long long save_id = 0u;
+	if (!LineJournal::read_save_id(journal.c_str(), save_id))
+		save_id = 0u;
+	if (save_id != 0u)
+	{
+		size_t bytes = LineJournal::replay(journal.c_str(), save_id, [](const JournalRecord&) {});
+		if (bytes > sizeof(LineJournalHeader) && open_document(path))
+			return true;
+	}
+
+	// Edits of a drawing never saved replay onto an empty one
+	reset_drawing();
+	size_t journal_bytes = save_id == 0u ? replay_journal(journal.c_str(), 0u) : 0u;
+	if (mLines.size() > 0u)
+	{
+		mLoading = true;
+		mLoadRasterize = true;
+		mLoadLineCount = mLines.size();
+		mLoadNextLine = 0u;
+		mLoadNextTile = 0u;
+		mLoadStart = std::chrono::high_resolution_clock::now();
+	}
+	mJournalLines = mLines.size();
+	return mJournal.open(journal.c_str(), 0u, journal_bytes);
+}
+
+bool Renderer::save_document(const char* path)
+{
+	// The mapped file can't be replaced while its records are in use, take a copy first
+	if (mDocument.is_open() && strcmp(mDocument.path(), path) == 0)
+	{
+		mLines.detach();
+		mDocument.close();
+	}
+	unsigned long long save_id = 0u;
+	if (!LineDocument::save(path, mLines, save_id))
+		return false;
+	fprintf(stdout, "Saved %zu lines to %s\n", mLines.live_count(), path);
+
+	// The journal starts over from this save, numbering lines the way it stored them
+	mJournalIds.clear();
+	if (mLines.live_count() != mLines.size())
+	{
+		mJournalIds.assign(mLines.size(), kNotJournaled);
+		size_t next = 0u;
+		for (size_t id = 0u; id < mLines.size(); ++id)
+		{
+			if (!mLines.is_removed(id))
+				mJournalIds[id] = next++;
+		}
+	}
+	mJournalLines = mLines.live_count();
+	mJournal.open((std::string(path) + ".journal").c_str(), save_id, 0u);
+
+	// Tiles still being filled in don't show the lines yet
+	if (mLoading || mImporter.is_active())
+		fprintf(stdout, "Canvas still loading, no snapshot saved.\n");
+	else
+		write_snapshot((std::string(path) + ".snap").c_str(), save_id);
+	return true;
+}
+
+bool Renderer::import_lines(const char* path)
+{
+	if (!mImporter.start(path, mColor))
+		return false;
+	mImportedLines = 0u;
+	mImportStart = std::chrono::high_resolution_clock::now();
+	fprintf(stdout, "Importing %s\n", path);
+	return true;
+}
+
+void Renderer::update_import()
+{
+	if (!mImporter.is_active())
+		return;
+	mPendingWork = true;
+	mBackBufferValid = false;
+
+	// Take whatever the workers have parsed so far, a batch at a time within the budget
+	auto start = std::chrono::high_resolution_clock::now();
+	bool more = true;
+	for (;;)
+	{
+		mImportBatch.clear();
+		more = mImporter.poll(mImportBatch, kImportBatchLines);
+		if (mImportBatch.empty())
+			break;
+
+		size_t first = mLines.size();
+		for (const Line& line : mImportBatch)
+		{
+			size_t id = mLines.add(line);
+			mIndex.insert(id, mLines.get(id));
+			journal_add(id);
+		}
+		commit_lines(first, mImportBatch.size());
+		mImportedLines += mImportBatch.size();
+
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		if (elapsed.count() >= kImportTimeBudget)
+			break;
+	}
+	if (more)
+		return;
+
+	// Undo entries stay, commit_lines sent the ones with snapshots of imported tiles to replay
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - mImportStart;
+	fprintf(stdout, "Imported %zu lines in %.1f ms, %zu rows skipped\n", mImportedLines, elapsed.count(), mImporter.rows_skipped());
+	mImporter.cancel();
+	std::vector<Line>().swap(mImportBatch);
+}
+
+void Renderer::read_canvas(int x, int y, int width, int height, int level, ReadbackCallback callback)
+{
+	// One piece per tile the rectangle overlaps, in tile pixels
+	std::vector<ReadbackPiece> pieces;
+	const int size = Canvas::kTileSize;
+	int min_x = x >= 0 ? x / size : -((size - 1 - x) / size);
+	int min_y = y >= 0 ? y / size : -((size - 1 - y) / size);
+	for (int tile_y = min_y; tile_y * size < y + height; ++tile_y)
+	{
+		for (int tile_x = min_x; tile_x * size < x + width; ++tile_x)
+		{
+			int x0 = tile_x * size > x ? tile_x * size : x;
+			int y0 = tile_y * size > y ? tile_y * size : y;
+			int x1 = (tile_x + 1) * size < x + width ? (tile_x + 1) * size : x + width;
+			int y1 = (tile_y + 1) * size < y + height ? (tile_y + 1) * size : y + height;
+			ReadbackPiece piece = { level, tile_x, tile_y, x0 - tile_x * size, y0 - tile_y * size, x1 - x0, y1 - y0, x0 - x, y0 - y, 0 };
+			pieces.push_back(piece);
+		}
+	}
+	ReadbackFormat format;
+	format.expand_red = mCanvas.format() == CanvasFormat::R8;
+	mReadback.request(width, height, std::move(pieces), format, std::move(callback));
+}
+
+bool Renderer::export_canvas(const char* path)
+{
+	int min_x, min_y, max_x, max_y;
+	if (!mCanvas.drawn_bounds(min_x, min_y, max_x, max_y))
+	{
+		fprintf(stdout, "Nothing drawn to export.\n");
+		return false;
+	}
+
+	// Whole level 0 tiles around everything drawn, encoded on the readback worker
+	int x = min_x * Canvas::kTileSize, y = min_y * Canvas::kTileSize;
+	int width = (max_x - min_x + 1) * Canvas::kTileSize, height = (max_y - min_y + 1) * Canvas::kTileSize;
+	std::string file = path;
+	auto start = std::chrono::high_resolution_clock::now();
+	fprintf(stdout, "Exporting %dx%d pixels to %s\n", width, height, path);
+	read_canvas(x, y, width, height, 0, [file, start](const ReadbackImage& image)
+	{
+		auto encode_start = std::chrono::high_resolution_clock::now();
+		ImageWriter writer;
+		size_t row_bytes = static_cast<size_t>(image.width) * 4u;
+		bool written = writer.open(file.c_str(), ImageWriter::format_from_path(file.c_str()), image.width, image.height) &&
+			writer.write_rows(image.pixels.data() + (image.height - 1) * row_bytes, image.height, -static_cast<ptrdiff_t>(row_bytes));
+		written = writer.close() && written;
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::milli> readback = encode_start - start, encode = end - encode_start;
+		if (written)
+			fprintf(stdout, "Exported %s: readback %.1f ms, encoding %.1f ms\n", file.c_str(), readback.count(), encode.count());
+	});
+	return true;
+}
+
+bool Renderer::export_poster(const char* path, int long_edge)
+{
+	if (mPoster)
+	{
+		fprintf(stdout, "Still exporting %s.\n", mPoster->path.c_str());
+		return false;
+	}
+	finish_document_index();
+
+	// Bounds of the lines, with room for their edge at the poster's scale
+	bool any = false;
+	float min_x = 0.0f, min_y = 0.0f, max_x = 0.0f, max_y = 0.0f;
+	for (size_t id = 0u; id < mLines.size(); ++id)
+	{
+		if (mLines.is_removed(id))
+			continue;
+		const Line& line = mLines.get(id);
+		float radius = line.radius > 0.0f ? line.radius : 0.0f;
+		float line_min_x = (line.start_x < line.end_x ? line.start_x : line.end_x) - radius;
+		float line_max_x = (line.start_x < line.end_x ? line.end_x : line.start_x) + radius;
+		float line_min_y = (line.start_y < line.end_y ? line.start_y : line.end_y) - radius;
+		float line_max_y = (line.start_y < line.end_y ? line.end_y : line.start_y) + radius;
+		min_x = !any || line_min_x < min_x ? line_min_x : min_x;
+		min_y = !any || line_min_y < min_y ? line_min_y : min_y;
+		max_x = !any || line_max_x > max_x ? line_max_x : max_x;
+		max_y = !any || line_max_y > max_y ? line_max_y : max_y;
+		any = true;
+	}
+	if (!any)
+	{
+		fprintf(stdout, "Nothing drawn to export.\n");
+		return false;
+	}
+	long_edge = long_edge < 1 ? 1 : (long_edge > kMaxPosterEdge ? kMaxPosterEdge : long_edge);
+	float extent = max_x - min_x > max_y - min_y ? max_x - min_x : max_y - min_y;
+	float margin = (kSDFFade + 1.0f) * (extent / long_edge > 1.0f ? extent / long_edge : 1.0f);
+	min_x -= margin;
+	min_y -= margin;
+	max_x += margin;
+	max_y += margin;
+	extent += 2.0f * margin;
+
+	std::shared_ptr<PosterJob> job = std::make_shared<PosterJob>();
+	job->pixel = extent / long_edge;
+	job->left = min_x;
+	job->top = max_y;
+	job->width = static_cast<int>(ceilf((max_x - min_x) / job->pixel));
+	job->height = static_cast<int>(ceilf((max_y - min_y) / job->pixel));
+	job->width = job->width < 1 ? 1 : (job->width > long_edge ? long_edge : job->width);
+	job->height = job->height < 1 ? 1 : (job->height > long_edge ? long_edge : job->height);
+	size_t strip_rows = kPosterStripBytes / (static_cast<size_t>(job->width) * 4u);
+	job->strip_rows = strip_rows < kPosterMinStripRows ? kPosterMinStripRows : (strip_rows > kPosterMaxStripRows ? kPosterMaxStripRows : static_cast<int>(strip_rows));
+	job->strip_count = (job->height + job->strip_rows - 1) / job->strip_rows;
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	job->chunk_width = max_size < kPosterChunkWidth ? max_size : kPosterChunkWidth;
+	job->chunk_count = (job->width + job->chunk_width - 1) / job->chunk_width;
+	job->path = path;
+	if (!job->writer.open(path, ImageWriter::format_from_path(path), job->width, job->height))
+		return false;
+
+	// Chunks get the same anti-aliasing committed lines do
+	job->samples = mMsaaSamples;
+	job->framebuffer = create_color_target(job->chunk_width, job->strip_rows, 0, GL_RGBA8, job->texture);
+	if (job->samples > 0)
+		job->msaa_framebuffer = create_color_target(job->chunk_width, job->strip_rows, job->samples, GL_RGBA8, job->msaa_storage);
+	set_window_target();
+	job->start = std::chrono::high_resolution_clock::now();
+	mPoster = job;
+	mBackBufferValid = false;
+	fprintf(stdout, "Exporting a %dx%d poster to %s, %d strips of %d rows\n", job->width, job->height, path, job->strip_count, job->strip_rows);
+	return true;
+}
+
+void Renderer::update_poster()
+{
+	if (!mPoster)
+		return;
+	PosterJob& job = *mPoster;
+	if (job.next_strip == job.strip_count)
+	{
+		// Everything is rendered, the readback worker writes the rest
+		if (!job.done)
+		{
+			mPendingWork = true;
+			return;
+		}
+		delete_color_target(job.framebuffer, job.texture, 0);
+		if (job.samples > 0)
+			delete_color_target(job.msaa_framebuffer, job.msaa_storage, job.samples);
+		mPoster.reset();
+		return;
+	}
+	mPendingWork = true;
+
+	// A chunk at a time while a readback buffer is free, the lines are the ones the index
+	// finds in it grown by a pixel for the edges
+	auto start = std::chrono::high_resolution_clock::now();
+	ReadbackFormat format;
+	format.expand_red = mCanvas.format() == CanvasFormat::R8;
+	while (job.next_strip < job.strip_count && mReadback.can_capture())
+	{
+		int x = job.next_chunk * job.chunk_width, y = job.next_strip * job.strip_rows;
+		int width = job.width - x < job.chunk_width ? job.width - x : job.chunk_width;
+		int rows = job.height - y < job.strip_rows ? job.height - y : job.strip_rows;
+		// Image rows run top down, the chunk's bottom row is the last row of the strip
+		float origin_x = job.left + x * job.pixel, origin_y = job.top - (y + rows) * job.pixel;
+		bool multisampled = job.samples > 0;
+		set_target(multisampled ? job.msaa_framebuffer : job.framebuffer, origin_x, origin_y, job.pixel, width, rows);
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		mIndex.query_region(mLines, origin_x - job.pixel, origin_y - job.pixel, origin_x + (width + 1) * job.pixel, origin_y + (rows + 1) * job.pixel, mRedrawLines);
+		render_lines(mRedrawLines.data(), mRedrawLines.size());
+		if (multisampled)
+		{
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, job.msaa_framebuffer);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, job.framebuffer);
+			glBlitFramebuffer(0, 0, width, rows, 0, 0, width, rows, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(job.mutex);
+			++job.in_flight;
+		}
+		std::shared_ptr<PosterJob> poster = mPoster;
+		int strip = job.next_strip;
+		mReadback.capture(job.framebuffer, 0, 0, width, rows, format, [poster, strip, x](const ReadbackImage& image)
+		{
+			add_poster_chunk(*poster, strip, x, image);
+		});
+		if (++job.next_chunk == job.chunk_count)
+		{
+			job.next_chunk = 0;
+			++job.next_strip;
+		}
+
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		if (elapsed.count() >= kPosterTimeBudget)
+			break;
+	}
+	set_window_target();
+}
+
+void Renderer::add_poster_chunk(PosterJob& job, int strip, int x, const ReadbackImage& image)
+{
+	{
+		std::lock_guard<std::mutex> lock(job.mutex);
+		if (job.aborted)
+		{
+			if (--job.in_flight == 0)
+				discard_poster(job);
+			return;
+		}
+	}
+
+	// Chunk rows are bottom up, strips top down
+	size_t row_bytes = static_cast<size_t>(job.width) * 4u, chunk_bytes = static_cast<size_t>(image.width) * 4u;
+	PosterStrip& target = job.strips[strip];
+	if (target.pixels.empty())
+	{
+		target.pixels.resize(row_bytes * image.height);
+		target.chunks_left = job.chunk_count;
+		job.peak_strips = job.strips.size() > job.peak_strips ? job.strips.size() : job.peak_strips;
+	}
+	for (int row = 0; row < image.height; ++row)
+		memcpy(&target.pixels[(image.height - 1 - row) * row_bytes + x * 4u], &image.pixels[row * chunk_bytes], chunk_bytes);
+
+	// Strips go to the encoder in order, ones finished early wait for those before
+	if (--target.chunks_left == 0)
+	{
+		for (auto it = job.strips.find(job.next_write); it != job.strips.end() && it->second.chunks_left == 0; it = job.strips.find(job.next_write))
+		{
+			job.writer.write_rows(it->second.pixels.data(), static_cast<int>(it->second.pixels.size() / row_bytes), static_cast<ptrdiff_t>(row_bytes));
+			job.strips.erase(it);
+			++job.next_write;
+		}
+		if (job.next_write == job.strip_count)
+		{
+			bool written = job.writer.close();
+			std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - job.start;
+			if (written)
+				fprintf(stdout, "Exported %s in %.1f s, at most %zu strips of %.1f MB held\n", job.path.c_str(), elapsed.count(), job.peak_strips, row_bytes * job.strip_rows / (1024.0 * 1024.0));
+			job.done = true;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(job.mutex);
+	if (--job.in_flight == 0 && job.aborted && !job.done)
+		discard_poster(job);
+}
+
+void Renderer::discard_poster(PosterJob& job)
+{
+	job.writer.close();
+	remove(job.path.c_str());
+	job.strips.clear();
+	job.done = true;
+	fprintf(stdout, "Poster export to %s cancelled.\n", job.path.c_str());
+}
+
+void Renderer::abort_poster()
+{
+	if (!mPoster)
+		return;
+
+	// Chunks still being read back clean up after themselves, the last one discards the file
+	{
+		std::lock_guard<std::mutex> lock(mPoster->mutex);
+		mPoster->aborted = true;
+		if (mPoster->in_flight == 0 && !mPoster->done)
+			discard_poster(*mPoster);
+	}
+	delete_color_target(mPoster->framebuffer, mPoster->texture, 0);
+	if (mPoster->samples > 0)
+		delete_color_target(mPoster->msaa_framebuffer, mPoster->msaa_storage, mPoster->samples);
+	mPoster.reset();
+}
+
+void Renderer::toggle_recording()
+{
+	if (mRecorder.is_recording())
+		mRecorder.stop();
+	else if (mRecorder.start(mCaptureFormat))
+		mBackBufferValid = false;	// So the recording starts with a frame
+}
+
+void Renderer::read_window(ReadbackCallback callback)
+{
+	mWindowReadback = std::move(callback);
+	mBackBufferValid = false;
+}
+
+bool Renderer::readback_source(const ReadbackPiece& piece, GLuint& framebuffer)
+{
+	// Snapshot tiles changed since it started were preserved as they were
+	if (piece.tag == kSnapshotReadback)
+	{
+		long long key = (static_cast<long long>(piece.tile_x) << 32) | static_cast<unsigned int>(piece.tile_y);
+		mSnapshotPending.erase(key);
+		auto it = mSnapshotPreserved.find(key);
+		Tile* tile = it != mSnapshotPreserved.end() ? &it->second : mCanvas.find_tile(0, piece.tile_x, piece.tile_y);
+		framebuffer = tile ? tile->framebuffer : 0u;
+		return true;
+	}
+
+	Tile* tile = piece.level > 0 ? update_pyramid_tile(piece.level, piece.tile_x, piece.tile_y) : mCanvas.find_tile(0, piece.tile_x, piece.tile_y);
+	if (tile && tile->dirty)
+		return false;
+	framebuffer = tile ? tile->framebuffer : 0u;
+	return true;
+}
+
+void Renderer::write_snapshot(const char* path, unsigned long long document_id)
+{
+	if (mSnapshot && !mSnapshot->done)
+	{
+		fprintf(stdout, "Previous snapshot still being written, %s skipped.\n", path);
+		return;
+	}
+
+	// The one before decides where the chain stands, a failed record breaks it
+	if (mSnapshot)
+	{
+		if (mSnapshot->failed)
+		{
+			mSnapshotPath.clear();
+		}
+		else if (mSnapshot->delta)
+		{
+			mSnapshotDeltaBytes += mSnapshot->writer.record_bytes();
+			++mSnapshotDeltas;
+		}
+		else
+		{
+			mSnapshotBaseBytes = mSnapshot->writer.record_bytes();
+			mSnapshotDeltaBytes = 0u;
+			mSnapshotDeltas = 0;
+		}
+		mSnapshot.reset();
+	}
+	free_snapshot_tiles();
+
+	// Only the tiles changed since the last record are written while the deltas stay small
+	// next to the full snapshot, past that everything is written again and the deltas go
+	bool delta = mSnapshotPath == path && mSnapshotDeltas < kMaxSnapshotDeltas && mSnapshotDeltaBytes * 2u < mSnapshotBaseBytes;
+	std::string delta_path = std::string(path) + ".delta";
+	std::shared_ptr<SnapshotJob> job = std::make_shared<SnapshotJob>();
+	if (!job->writer.begin(delta ? delta_path.c_str() : path, mCanvas.format(), mCanvas.tile_bytes(), document_id, delta ? mSnapshotId : 0u, mCompressSnapshots))
+	{
+		mSnapshotPath.clear();
+		return;
+	}
+	job->path = delta ? delta_path : path;
+	job->delta = delta;
+	job->start = std::chrono::high_resolution_clock::now();
+	mSnapshot = job;
+	mSnapshotPath = path;
+	mSnapshotId = document_id;
+
+	// Tiles on the GPU are read back in batches stacked into one image, cold ones are
+	// compressed already and go to the worker as they are
+	std::vector<StoredTile> stored;
+	std::vector<std::pair<int, int>> removed;
+	if (delta)
+	{
+		for (long long key : mSnapshotDirty)
+		{
+			StoredTile tile = { static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffff), nullptr };
+			if (mCanvas.stored_tile(tile.x, tile.y, tile))
+				stored.push_back(tile);
+			else
+				removed.push_back(std::make_pair(tile.x, tile.y));
+		}
+	}
+	else
+	{
+		mCanvas.stored_tiles(stored);
+	}
+	mSnapshotDirty.clear();
+
+	std::vector<std::pair<int, int>> resident;
+	std::vector<std::pair<std::pair<int, int>, std::vector<unsigned char>>> cold;
+	for (const StoredTile& tile : stored)
+	{
+		if (tile.compressed)
+			cold.push_back(std::make_pair(std::make_pair(tile.x, tile.y), *tile.compressed));
+		else
+			resident.push_back(std::make_pair(tile.x, tile.y));
+	}
+	job->batches_left = (resident.size() + kSnapshotBatchTiles - 1u) / kSnapshotBatchTiles + 1u;
+
+	ReadbackFormat format;
+	format.format = mCanvas.client_format();
+	format.type = mCanvas.client_type();
+	format.pixel_bytes = mCanvas.pixel_bytes();
+	auto cold_tiles = std::make_shared<decltype(cold)>(std::move(cold));
+	mReadback.request(0, 0, std::vector<ReadbackPiece>(), format, [job, cold_tiles, removed](const ReadbackImage&)
+	{
+		for (const auto& tile : *cold_tiles)
+			if (!job->aborted)
+				job->writer.add_compressed(tile.first.first, tile.first.second, tile.second.data(), tile.second.size());
+		for (const auto& tile : removed)
+			job->writer.add_removed(tile.first, tile.second);
+		finish_snapshot_batch(*job);
+	});
+
+	const int size = Canvas::kTileSize;
+	size_t tile_bytes = mCanvas.tile_bytes();
+	for (size_t first = 0u; first < resident.size(); first += kSnapshotBatchTiles)
+	{
+		size_t count = resident.size() - first < kSnapshotBatchTiles ? resident.size() - first : kSnapshotBatchTiles;
+		std::vector<std::pair<int, int>> tiles(resident.begin() + first, resident.begin() + first + count);
+		std::vector<ReadbackPiece> pieces;
+		for (size_t i = 0u; i < count; ++i)
+		{
+			ReadbackPiece piece = { 0, tiles[i].first, tiles[i].second, 0, 0, size, size, 0, static_cast<int>(i) * size, kSnapshotReadback };
+			pieces.push_back(piece);
+			mSnapshotPending.insert((static_cast<long long>(tiles[i].first) << 32) | static_cast<unsigned int>(tiles[i].second));
+		}
+		mReadback.request(size, size * static_cast<int>(count), std::move(pieces), format, [job, tiles, tile_bytes](const ReadbackImage& image)
+		{
+			for (size_t i = 0u; i < tiles.size() && !job->aborted; ++i)
+				job->writer.add_tile(tiles[i].first, tiles[i].second, image.pixels.data() + i * tile_bytes);
+			finish_snapshot_batch(*job);
+		});
+	}
+}
+
+void Renderer::finish_snapshot_batch(SnapshotJob& job)
 {
-	// Create texture for framebuffer
-	glGenTextures(1, &mFramebufferTexture);
-	glBindTexture(GL_TEXTURE_2D, mFramebufferTexture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	if (--job.batches_left > 0u)
+		return;
+	if (job.aborted)
+	{
+		job.writer.abort();
+		job.failed = true;
+	}
+	else if (job.writer.finish())
+	{
+		// A new full snapshot starts a new chain, older deltas no longer apply
+		if (!job.delta)
+			remove((job.path + ".delta").c_str());
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - job.start;
+		fprintf(stdout, "Snapshot %s: %zu tiles, %.1f MB in %.1f ms\n", job.path.c_str(), job.writer.tile_count(),
+			job.writer.record_bytes() / (1024.0 * 1024.0), elapsed.count());
+	}
+	else
+	{
+		job.failed = true;
+	}
+	job.done = true;
+}
 
-	// Create framebuffer
-	glGenFramebuffers(1, &mFramebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, mFramebuffer);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mFramebufferTexture, 0);
-	GLenum color_attachments[] = {
-		GL_COLOR_ATTACHMENT0
+void Renderer::before_tile_change(int x, int y)
+{
+	long long key = (static_cast<long long>(x) << 32) | static_cast<unsigned int>(y);
+	mSnapshotDirty.insert(key);
+	if (mSnapshotPending.find(key) == mSnapshotPending.end() || mSnapshotPreserved.find(key) != mSnapshotPreserved.end())
+		return;
+
+	// Copied on the GPU like undo snapshots, the readback picks the copy up later
+	Tile* tile = mCanvas.find_tile(0, x, y);
+	if (!tile || !tile->framebuffer)
+		return;
+	Tile copy;
+	if (!mCanvas.allocate_tile(copy))
+	{
+		// Without the copy the snapshot would show the change, so it is given up
+		fprintf(stdout, "Snapshot copy of tile (%d, %d) failed, snapshot abandoned.\n", x, y);
+		Canvas::free_tile(copy);
+		if (mSnapshot)
+			mSnapshot->aborted = true;
+		return;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, tile->framebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, copy.framebuffer);
+	glBlitFramebuffer(0, 0, Canvas::kTileSize, Canvas::kTileSize, 0, 0, Canvas::kTileSize, Canvas::kTileSize, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	mSnapshotPreserved[key] = std::move(copy);
+}
+
+void Renderer::free_snapshot_tiles()
+{
+	for (auto& it : mSnapshotPreserved)
+		Canvas::free_tile(it.second);
+	mSnapshotPreserved.clear();
+	mSnapshotPending.clear();
+}
+
+bool Renderer::restore_snapshot(const char* path)
+{
+	SnapshotReader base;
+	if (!base.open(path))
+		return false;
+	unsigned int format = static_cast<unsigned int>(mCanvas.format());
+	unsigned long long id = base.header().document_id;
+	if (base.header().format != format || id == 0u)
+	{
+		fprintf(stdout, "%s was taken for another canvas format, rasterizing instead.\n", path);
+		return false;
+	}
+
+	// Newest entry per tile, from the full snapshot and then each delta continuing from
+	// the save before it until the one for this document
+	typedef std::pair<const SnapshotEntry*, const unsigned char*> StoredEntry;
+	std::unordered_map<long long, StoredEntry> tiles;
+	auto collect = [&tiles](const SnapshotReader& reader)
+	{
+		for (unsigned int i = 0u; i < reader.header().tile_count; ++i)
+		{
+			const SnapshotEntry& entry = reader.entries()[i];
+			tiles[(static_cast<long long>(entry.x) << 32) | static_cast<unsigned int>(entry.y)] = StoredEntry(&entry, reader.data(entry));
+		}
 	};
-	glDrawBuffers(sizeof(color_attachments) / sizeof(GLenum), color_attachments);
+	collect(base);
+	SnapshotReader delta;
+	int deltas = 0;
+	std::string delta_path = std::string(path) + ".delta";
+	FILE* stale = id == mDocument.save_id() ? fopen(delta_path.c_str(), "rb") : nullptr;
+	bool chain_clean = stale == nullptr;
+	if (stale)
+		fclose(stale);
+	if (id != mDocument.save_id() && delta.open(delta_path.c_str()))
+	{
+		for (;;)
+		{
+			const SnapshotHeader& record = delta.header();
+			if (record.parent_id != id || record.format != format)
+				break;
+			collect(delta);
+			id = record.document_id;
+			++deltas;
+			if (id == mDocument.save_id())
+			{
+				chain_clean = !delta.next() && delta.at_end();
+				break;
+			}
+			if (!delta.next())
+				break;
+		}
+	}
+	if (id != mDocument.save_id())
+	{
+		fprintf(stdout, "%s was taken for another save, rasterizing instead.\n", path);
+		return false;
+	}
 
-	// Error checking
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		fprintf(stdout, "Framebuffer failed to complete.\n");
+	// Compressed tiles come back cold and are decoded once seen, raw ones are uploaded
+	// straight from the mapping
+	auto start = std::chrono::high_resolution_clock::now();
+	size_t tile_bytes = mCanvas.tile_bytes();
+	for (const auto& it : tiles)
+	{
+		const SnapshotEntry& entry = *it.second.first;
+		if (entry.size == 0u || (!entry.compressed && entry.size != tile_bytes))
+			continue;
+		mCanvas.load_tile(entry.x, entry.y, it.second.second, entry.size, entry.compressed != 0u);
+		mCanvas.mark_ancestors_dirty(entry.x, entry.y);
+	}
+	set_window_target();
+
+	// Later saves append to the chain, unless something it can't continue is in the way
+	mSnapshotPath = chain_clean ? path : "";
+	mSnapshotId = id;
+	mSnapshotBaseBytes = base.size();
+	mSnapshotDeltaBytes = delta.size();
+	mSnapshotDeltas = deltas;
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+	fprintf(stdout, "Restored %zu tiles from %s and %d deltas in %.1f ms\n", mCanvas.tile_count() + mCanvas.compressed_tile_count(), path, deltas, elapsed.count());
+	return true;
+}
+
+void Renderer::reset_drawing()
+{
+	// A snapshot in progress would capture the wrong drawing
+	if (mSnapshot)
+		mSnapshot->aborted = true;
+	abort_poster();
+	free_snapshot_tiles();
+	mSnapshotDirty.clear();
+	mSnapshotPath.clear();
+	// Unsaved edits stay in the journal file for the next time the document is opened
+	mJournal.close();
+	mJournalIds.clear();
+	mJournalLines = 0u;
+	mImporter.cancel();
+	mCanvas.release();
+	mDetailTiles.clear();
+	mReadyDetailTiles.clear();
+	mJobLines.clear();
+	mJobActive = false;
+	mHistory.clear();
+	mIndex.clear();
+	mLines.clear();
+	mDocument.close();
+	mUploadedLines = 0u;
+	mLoading = false;
+	mLoadTileSet.clear();
+	mLoadTiles.clear();
+	mBackBufferValid = false;
+}
+
+void Renderer::update_document_load()
+{
+	if (!mLoading)
+		return;
+	mPendingWork = true;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	auto out_of_time = [&start]()
+	{
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		return elapsed.count() >= kLoadTimeBudget;
+	};
+
+	// Every line has to be known before any tile can be rasterized in full
+	while (mLoadNextLine < mLoadLineCount)
+	{
+		size_t end = mLoadNextLine + kLoadLineChunk;
+		index_document_lines(end < mLoadLineCount ? end : mLoadLineCount);
+		if (out_of_time())
+			return;
+	}
+
+	// Then the tiles they reach, nearest to the camera first
+	if (!mLoadTileSet.empty())
+	{
+		mLoadTiles.assign(mLoadTileSet.begin(), mLoadTileSet.end());
+		mLoadTileSet.clear();
+		const float size = static_cast<float>(Canvas::kTileSize);
+		float camera_x = mCameraX / size - 0.5f, camera_y = mCameraY / size - 0.5f;
+		std::sort(mLoadTiles.begin(), mLoadTiles.end(), [camera_x, camera_y](long long a, long long b)
+		{
+			float ax = static_cast<int>(a >> 32) - camera_x, ay = static_cast<int>(a & 0xffffffff) - camera_y;
+			float bx = static_cast<int>(b >> 32) - camera_x, by = static_cast<int>(b & 0xffffffff) - camera_y;
+			return ax * ax + ay * ay < bx * bx + by * by;
+		});
+	}
+	while (mLoadNextTile < mLoadTiles.size())
+	{
+		long long key = mLoadTiles[mLoadNextTile++];
+		rasterize_document_tile(static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffff));
+		if (out_of_time())
+		{
+			set_window_target();
+			return;
+		}
+	}
+	set_window_target();
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - mLoadStart;
+	fprintf(stdout, "Document ready: %zu lines, %zu tiles in %.1f ms\n", mLoadLineCount, mLoadTiles.size(), elapsed.count());
+	mLoading = false;
+	mLoadTiles.clear();
+	mLoadTiles.shrink_to_fit();
+}
+
+void Renderer::index_document_lines(size_t end)
+{
+	// Lines the journal removed are skipped
+	for (; mLoadNextLine < end; ++mLoadNextLine)
+	{
+		if (mLines.is_removed(mLoadNextLine))
+			continue;
+		const Line& line = mLines.get(mLoadNextLine);
+		mIndex.insert(mLoadNextLine, line);
+		if (mLoadRasterize)
+			collect_line_tiles(line, mLoadTileSet);
+	}
+	sync_line_buffer(mLoadNextLine);
+}
+
+void Renderer::collect_line_tiles(const Line& line, std::unordered_set<long long>& tiles) const
+{
+	const float size = static_cast<float>(Canvas::kTileSize);
+	float padding = line_padding(line);
+	int min_x = Canvas::tile_coordinate(0, (line.start_x < line.end_x ? line.start_x : line.end_x) - padding);
+	int max_x = Canvas::tile_coordinate(0, (line.start_x < line.end_x ? line.end_x : line.start_x) + padding);
+	int min_y = Canvas::tile_coordinate(0, (line.start_y < line.end_y ? line.start_y : line.end_y) - padding);
+	int max_y = Canvas::tile_coordinate(0, (line.start_y < line.end_y ? line.end_y : line.start_y) + padding);
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			float origin_x = x * size, origin_y = y * size;
+			if (segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, padding, origin_x, origin_y, origin_x + size, origin_y + size))
+				tiles.insert((static_cast<long long>(x) << 32) | static_cast<unsigned int>(y));
+		}
+	}
+}
+
+size_t Renderer::replay_journal(const char* path, unsigned long long save_id)
+{
+	// Records naming lines that don't exist would come from a broken journal, they are
+	// skipped rather than trusted
+	size_t edits = 0u;
+	auto start = std::chrono::high_resolution_clock::now();
+	size_t bytes = LineJournal::replay(path, save_id, [this, &edits](const JournalRecord& record)
+	{
+		size_t id = record.id;
+		if (record.type == JournalRecord::Type::Add)
+			id = mLines.add(record.line);
+		else if (id >= mLines.size())
+			return;
+		else if (record.type == JournalRecord::Type::Remove)
+			mLines.remove(id);
+		else
+			mLines.restore(id);
+		collect_line_tiles(mLines.get(id), mLoadTileSet);
+		++edits;
+	});
+	if (edits == 0u)
+		return bytes;
+
+	// Not in the document or its snapshot yet, the next save has to include them
+	mSnapshotDirty.insert(mLoadTileSet.begin(), mLoadTileSet.end());
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+	fprintf(stdout, "Recovered %zu edits from %s in %.1f ms\n", edits, path, elapsed.count());
+	return bytes;
+}
 
+void Renderer::journal_add(size_t id)
+{
+	if (!mJournalIds.empty())
+		mJournalIds.push_back(mJournalLines);
+	++mJournalLines;
+	mJournal.append_add(mLines.get(id));
+}
+
+void Renderer::journal_remove(size_t id)
+{
+	mJournal.append_remove(mJournalIds.empty() ? id : mJournalIds[id]);
+}
+
+void Renderer::journal_restore(size_t id)
+{
+	size_t journal_id = mJournalIds.empty() ? id : mJournalIds[id];
+	if (journal_id != kNotJournaled)
+	{
+		mJournal.append_restore(journal_id);
+		return;
+	}
+
+	// Removed before the save so not in the document, the journal adds it again
+	mJournalIds[id] = mJournalLines++;
+	mJournal.append_add(mLines.get(id));
+}
+
+void Renderer::finish_document_index()
+{
+	// Picking and removing lines need the whole document in the index
+	if (mLoading && mLoadNextLine < mLoadLineCount)
+		index_document_lines(mLoadLineCount);
+}
+
+void Renderer::rasterize_document_tile(int x, int y)
+{
+	const float size = static_cast<float>(Canvas::kTileSize);
+	float origin_x = x * size, origin_y = y * size;
+	Tile& tile = mCanvas.acquire_tile(0, x, y);
+	mCanvas.mark_ancestors_dirty(x, y);
+	// Edits made while loading snapshotted the tile before it had the document's lines
+	mHistory.invalidate_tile(x, y);
+	mIndex.query_region(mLines, origin_x, origin_y, origin_x + size, origin_y + size, mRedrawLines);
+
+	bool multisampled = mMsaaSamples > 0;
+	set_target(multisampled ? mMsaaFramebuffer : tile.framebuffer, origin_x, origin_y, 1.0f, Canvas::kTileSize, Canvas::kTileSize);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
+	render_lines(mRedrawLines.data(), mRedrawLines.size());
+	if (multisampled)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, mMsaaFramebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, tile.framebuffer);
+		glBlitFramebuffer(0, 0, Canvas::kTileSize, Canvas::kTileSize, 0, 0, Canvas::kTileSize, Canvas::kTileSize, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+}
 
+void Renderer::apply_history(HistoryEntry& entry, bool restore_lines)
+{
+	for (size_t id : entry.lines)
+	{
+		if (restore_lines)
+		{
+			mLines.restore(id);
+			mIndex.insert(id, mLines.get(id));
+			journal_restore(id);
+		}
+		else
+		{
+			mIndex.remove(id, mLines.get(id));
+			mLines.remove(id);
+			journal_remove(id);
+		}
+	}
+
+	// Swapping in the snapshots costs the same whatever the history length
+	bool replay = entry.replay;
+	if (!replay)
+	{
+		for (const TileSnapshot& snapshot : entry.tiles)
+			before_tile_change(snapshot.x, snapshot.y);
+		mHistory.exchange(entry, mCanvas);
+	}
+	redraw_lines(entry.lines, replay);
+	mBackBufferValid = false;
+}
+
+void Renderer::set_max_frames_in_flight(int frames)
+{
+	if (frames < 1)
+		frames = 1;
+	else if (frames > kMaxFramesInFlight)
+		frames = kMaxFramesInFlight;
+
+	print_frame_stats();
+	mMaxFramesInFlight = frames;
+	mStatsFrames = mStatsQueueDepth = 0;
+	mStatsMaxQueueDepth = 0;
+	mStatsWaitTime = 0.0;
+}
+
+void Renderer::print_frame_stats()
+{
+	if (mStatsFrames == 0)
+		return;
+
+	double frames = static_cast<double>(mStatsFrames);
+	fprintf(stdout, "Frames in flight %d: %lld frames, average queue depth %.2f, max %d, waited %.3f ms per frame\n",
+		mMaxFramesInFlight, mStatsFrames, mStatsQueueDepth / frames, mStatsMaxQueueDepth, mStatsWaitTime / frames);
+}
+
+void Renderer::toggle_latency_measurement()
+{
+	mMeasureLatency = !mMeasureLatency;
+	if (mMeasureLatency)
+	{
+		fprintf(stdout, "Latency measurement on\n");
+		calibrate_gpu_clock();
+		mLatency.clear();
+	}
+	else
+		mLatency.print_report("Input to GPU");
+}
+
+void Renderer::set_msaa_samples(int samples)
+{
+	if (samples > mMaxMsaaSamples)
+		samples = mMaxMsaaSamples;
+	if (samples == mMsaaSamples)
+		return;
+
+	if (mMsaaSamples > 0)
+		delete_color_target(mMsaaFramebuffer, mMsaaRenderbuffer, mMsaaSamples);
+	mMsaaFramebuffer = mMsaaRenderbuffer = 0u;
+	mMsaaSamples = samples;
+	if (samples <= 0)
+	{
+		mMsaaSamples = 0;
+		fprintf(stdout, "MSAA off\n");
+		return;
+	}
+
+	// Scratch tile, seeded from the canvas tile on every commit
+	mMsaaFramebuffer = create_color_target(Canvas::kTileSize, Canvas::kTileSize, samples, mCanvas.internal_format(), mMsaaRenderbuffer);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0u);
+	fprintf(stdout, "MSAA %dx\n", samples);
+}
+
+void Renderer::cycle_msaa_samples()
+{
+	int samples = mMsaaSamples == 0 ? 2 : mMsaaSamples * 2;
+	set_msaa_samples(samples > mMaxMsaaSamples ? 0 : samples);
+}
+
+void Renderer::run_line_benchmark()
+{
+	struct Config
+	{
+		const char* name;
+		bool simple;
+		int samples;
+	};
+	const Config configs[] = {
+		{ "SDF", false, 0 },
+		{ "simple", true, 0 },
+		{ "simple MSAA 2x", true, 2 },
+		{ "simple MSAA 4x", true, 4 },
+		{ "simple MSAA 8x", true, 8 },
+		{ "simple MSAA 16x", true, 16 }
+	};
+
+	for (const Config& config : configs)
+	{
+		if (config.samples > mMaxMsaaSamples)
+			continue;
+
+		// Offscreen targets so the benchmark doesn't touch the cached lines
+		GLuint resolve_texture = 0u;
+		GLuint resolve_framebuffer = create_color_target(mWidth, mHeight, 0, mCanvas.internal_format(), resolve_texture);
+		GLuint msaa_renderbuffer = 0u;
+		GLuint msaa_framebuffer = config.samples > 0 ? create_color_target(mWidth, mHeight, config.samples, mCanvas.internal_format(), msaa_renderbuffer) : 0u;
+
+		// Same sequence of lines for every configuration
+		std::mt19937 generator(1234u);
+		std::uniform_int_distribution<int> x_distribution(-static_cast<int>(mHalfWidth), static_cast<int>(mHalfWidth));
+		std::uniform_int_distribution<int> y_distribution(-static_cast<int>(mHalfHeight), static_cast<int>(mHalfHeight));
+
+		glFinish();
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < kLineBenchmarkLines; ++i)
+		{
+			Line line;
+			line.start_x = static_cast<float>(x_distribution(generator));
+			line.start_y = static_cast<float>(y_distribution(generator));
+			line.end_x = static_cast<float>(x_distribution(generator));
+			line.end_y = static_cast<float>(y_distribution(generator));
+			line.radius = config.simple ? 0.0f : mRadius;
+			line.color = mColor;
+			if (msaa_framebuffer)
+			{
+				set_target(msaa_framebuffer, -mHalfWidth, -mHalfHeight, 1.0f, mWidth, mHeight);
+				render_line(line);
+				resolve_line(line, msaa_framebuffer, resolve_framebuffer);
+			}
+			else
+			{
+				set_target(resolve_framebuffer, -mHalfWidth, -mHalfHeight, 1.0f, mWidth, mHeight);
+				render_line(line);
+			}
+		}
+		glFinish();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		fprintf(stdout, "Line benchmark %s: %.2f ms for %d lines, %.4f ms per line\n",
+			config.name, elapsed.count(), kLineBenchmarkLines, elapsed.count() / kLineBenchmarkLines);
+
+		if (msaa_framebuffer)
+			delete_color_target(msaa_framebuffer, msaa_renderbuffer, config.samples);
+		delete_color_target(resolve_framebuffer, resolve_texture, 0);
+	}
+	set_window_target();
+	mBackBufferValid = false;
 }
 
 void Renderer::create_buffers()
@@ -112,6 +1512,10 @@ void Renderer::create_buffers()
 		static_cast<float>(mEndX), static_cast<float>(mEndY)
 	};
 	glBufferData(GL_ARRAY_BUFFER, sizeof(line), line, GL_DYNAMIC_DRAW);
+
+	// Line ids of the batched draws, the line records themselves are uploaded on first use
+	glGenBuffers(1, &mIdBuffer);
+	glGenTextures(1, &mLineTexture);
 }
 
 void Renderer::create_shaders()
@@ -124,11 +1528,14 @@ void Renderer::create_shaders()
 		"layout(location = 0) in vec2 v_position;\n"
 		"layout(location = 1) in vec2 v_uv;\n"
 
+		// Scale and offset of the plane in normalized device coordinates
+		"uniform vec4 transform;\n"
+
 		"out vec2 f_uv;\n"
 
 		"void main()\n"
 		"{\n"
-		"gl_Position = vec4(v_position, 0.0f, 1.0f);\n"
+		"gl_Position = vec4(v_position * transform.xy + transform.zw, 0.0f, 1.0f);\n"
 		"f_uv = v_uv;\n"
 		"}";
 	glShaderSource(vertexShader, 1, &v_code, 0);
@@ -161,18 +1568,174 @@ void Renderer::create_shaders()
 	glDetachShader(mProgramToDisplay, fragmentShader);
 	glDetachShader(mProgramToDisplay, vertexShader);
 
-	// SDF program
-	GLuint fragmentSDFShader = glCreateShader(GL_FRAGMENT_SHADER);
-	const GLchar* fsdf_code =
+	// SDF program
+	GLuint fragmentSDFShader = glCreateShader(GL_FRAGMENT_SHADER);
+	const GLchar* fsdf_code =
+		"#version 330\n"
+
+		// Everything in canvas pixels, origin is the canvas position of the target's pixel (0, 0)
+		// and scale the canvas pixels per target pixel
+		"uniform vec2 origin;\n"
+		"uniform float scale;\n"
+		"uniform vec2 start;\n"
+		"uniform vec2 end;\n"
+		"uniform vec3 color;\n"
+		"uniform float radius;\n"
+		"uniform float fade;\n"
+
+		"out vec4 fragColor;\n"
+
+		"float udSegment( in vec2 p, in vec2 a, in vec2 b )\n"
+		"{\n"
+			"vec2 ba = b - a;\n"
+			"vec2 pa = p - a;\n"
+			"float h = clamp(dot(pa, ba) / dot(ba, ba), 0.0, 1.0);\n"
+			"return length(pa - h * ba);\n"
+		"}\n"
+
+		"void main()\n"
+		"{\n"
+			"vec2 p = gl_FragCoord.xy * scale + origin;\n"
+			"float d = udSegment(p, start, end) - radius;\n"
+
+			"float alpha = 1.0f - sign(d);\n"
+			// Smooth edges. Inside is 2 before the clamp, which float targets would keep
+			"alpha = clamp(mix(alpha, 1.0, 1.0 - smoothstep(0.0, fade, abs(d))), 0.0, 1.0);\n"
+
+			"fragColor = vec4(color * alpha, alpha);\n"
+		"}";
+	glShaderSource(fragmentSDFShader, 1, &fsdf_code, 0);
+	glCompileShader(fragmentSDFShader);
+	check_shader_compiled(fragmentSDFShader, "SDFFragment");
+
+	// Line rendering program
+	mProgramSDF = glCreateProgram();
+	glAttachShader(mProgramSDF, vertexShader);
+	glAttachShader(mProgramSDF, fragmentSDFShader);
+	glLinkProgram(mProgramSDF);
+	check_program_linked(mProgramSDF, "SDFProgram");
+	glDetachShader(mProgramSDF, fragmentSDFShader);
+	glDetachShader(mProgramSDF, vertexShader);
+
+	// Release resources we no longer need
+	glDeleteShader(fragmentSDFShader);
+	glDeleteShader(fragmentShader);
+	glDeleteShader(vertexShader);
+
+	//------------------------------
+	// Simple line rendering program
+	vertexShader = glCreateShader(GL_VERTEX_SHADER);
+	v_code =
+		"#version 330\n"
+
+		"layout(location = 0) in vec2 v_position;\n"
+
+		// Canvas pixels to normalized device coordinates of the target
+		"uniform vec4 transform;\n"
+
+		"out vec2 f_uv;\n"
+
+		"void main()\n"
+		"{\n"
+			"gl_Position = vec4(v_position * transform.xy + transform.zw, 0.0f, 1.0f);\n"
+		"}";
+	glShaderSource(vertexShader, 1, &v_code, 0);
+	glCompileShader(vertexShader);
+	check_shader_compiled(vertexShader, "vertexLine");
+
+	fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+	f_code =
+		"#version 330\n"
+
+		"in vec2 f_uv;\n"
+
+		"uniform vec3 color;\n"
+
+		"out vec4 out_color;\n"
+		"void main()\n"
+		"{\n"
+			"out_color = vec4(color, 1.0f);\n"
+		"}";
+	glShaderSource(fragmentShader, 1, &f_code, 0);
+	glCompileShader(fragmentShader);
+	check_shader_compiled(fragmentShader, "framgentLine");
+
+	mProgramSimple = glCreateProgram();
+	glAttachShader(mProgramSimple, vertexShader);
+	glAttachShader(mProgramSimple, fragmentShader);
+	glLinkProgram(mProgramSimple);
+	check_program_linked(mProgramSimple, "SDFProgram");
+	glDetachShader(mProgramSimple, fragmentShader);
+	glDetachShader(mProgramSimple, vertexShader);
+
+	// Release resources we no longer need
+	glDeleteShader(fragmentShader);
+	glDeleteShader(vertexShader);
+
+	//------------------------------
+	// Batched programs, one instance per line id read from the GPU line buffer. Each line
+	// is three RG32UI texels: start, end, then radius and packed color
+	const GLchar* batch_common =
+		"#version 330\n"
+
+		"layout(location = 2) in uint v_line;\n"
+
+		"uniform usamplerBuffer lines;\n"
+		"uniform bool coverage_only;\n"
+
+		"void fetch_line(out vec2 start, out vec2 end, out float radius, out vec3 color)\n"
+		"{\n"
+			"int base = int(v_line) * 3;\n"
+			"start = uintBitsToFloat(texelFetch(lines, base).xy);\n"
+			"end = uintBitsToFloat(texelFetch(lines, base + 1).xy);\n"
+			"uvec2 rest = texelFetch(lines, base + 2).xy;\n"
+			"radius = uintBitsToFloat(rest.x);\n"
+			"color = coverage_only ? vec3(1.0) : vec3(rest.y & 0xffu, (rest.y >> 8) & 0xffu, (rest.y >> 16) & 0xffu) / 255.0;\n"
+		"}\n";
+
+	vertexShader = glCreateShader(GL_VERTEX_SHADER);
+	v_code =
+		// Quad over the capsule bounds, in the same target space as the SDF program
+		"layout(location = 0) in vec2 v_position;\n"
+
+		"uniform vec2 origin;\n"
+		"uniform float scale;\n"
+		"uniform vec2 size;\n"
+		"uniform float fade;\n"
+
+		"flat out vec2 f_start;\n"
+		"flat out vec2 f_end;\n"
+		"flat out float f_radius;\n"
+		"flat out vec3 f_color;\n"
+
+		"void main()\n"
+		"{\n"
+			"fetch_line(f_start, f_end, f_radius, f_color);\n"
+			"float reach = f_radius + fade + scale;\n"
+			"vec2 corner = mix(min(f_start, f_end) - reach, max(f_start, f_end) + reach, v_position * 0.5 + 0.5);\n"
+			"gl_Position = vec4((corner - origin) / (scale * size) * 2.0 - 1.0, 0.0f, 1.0f);\n"
+		"}";
+	const GLchar* batch_sdf_vertex[] = { batch_common, v_code };
+	glShaderSource(vertexShader, 2, batch_sdf_vertex, 0);
+	glCompileShader(vertexShader);
+	check_shader_compiled(vertexShader, "batchSDFVertex");
+
+	fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+	f_code =
 		"#version 330\n"
 
-		"uniform ivec2 start;\n"
-		"uniform ivec2 end;\n"
-		"uniform vec3 color;\n"
-		"uniform float radius;\n"
+		"uniform vec2 origin;\n"
+		"uniform float scale;\n"
+		"uniform float fade;\n"
+
+		"flat in vec2 f_start;\n"
+		"flat in vec2 f_end;\n"
+		"flat in float f_radius;\n"
+		"flat in vec3 f_color;\n"
 
 		"out vec4 fragColor;\n"
 
+		// Same coverage as the per line SDF program, so both paths give the same pixels
 		"float udSegment( in vec2 p, in vec2 a, in vec2 b )\n"
 		"{\n"
 			"vec2 ba = b - a;\n"
@@ -183,80 +1746,67 @@ void Renderer::create_shaders()
 
 		"void main()\n"
 		"{\n"
-			"vec2 p = (gl_FragCoord.xy - 512.0f) / 512.0f;\n"
-
-			"vec2 v1 = vec2(start / 512.0f);\n"
-			"vec2 v2 = vec2(end / 512.0f);\n"
-			"float d = udSegment(p, v1, v2) - radius;\n"
-
+			"vec2 p = gl_FragCoord.xy * scale + origin;\n"
+			"float d = udSegment(p, f_start, f_end) - f_radius;\n"
 			"float alpha = 1.0f - sign(d);\n"
-			// Smooth edges
-			"alpha = mix(alpha, 1.0, 1.0 - smoothstep(0.0, 0.005, abs(d)));\n"
-
-			"fragColor = vec4(color, alpha);\n"
+			"alpha = clamp(mix(alpha, 1.0, 1.0 - smoothstep(0.0, fade, abs(d))), 0.0, 1.0);\n"
+			"fragColor = vec4(f_color * alpha, alpha);\n"
 		"}";
-	glShaderSource(fragmentSDFShader, 1, &fsdf_code, 0);
-	glCompileShader(fragmentSDFShader);
-	check_shader_compiled(fragmentSDFShader, "SDFFragment");
-
-	// Line rendering program
-	mProgramSDF = glCreateProgram();
-	glAttachShader(mProgramSDF, vertexShader);
-	glAttachShader(mProgramSDF, fragmentSDFShader);
-	glLinkProgram(mProgramSDF);
-	check_program_linked(mProgramSDF, "SDFProgram");
-	glDetachShader(mProgramSDF, fragmentSDFShader);
-	glDetachShader(mProgramSDF, vertexShader);
+	glShaderSource(fragmentShader, 1, &f_code, 0);
+	glCompileShader(fragmentShader);
+	check_shader_compiled(fragmentShader, "batchSDFFragment");
 
-	// Release resources we no longer need
-	glDeleteShader(fragmentSDFShader);
+	mProgramBatchSDF = glCreateProgram();
+	glAttachShader(mProgramBatchSDF, vertexShader);
+	glAttachShader(mProgramBatchSDF, fragmentShader);
+	glLinkProgram(mProgramBatchSDF);
+	check_program_linked(mProgramBatchSDF, "BatchSDFProgram");
+	glDetachShader(mProgramBatchSDF, fragmentShader);
+	glDetachShader(mProgramBatchSDF, vertexShader);
 	glDeleteShader(fragmentShader);
 	glDeleteShader(vertexShader);
 
-	//------------------------------
-	// Simple line rendering program
 	vertexShader = glCreateShader(GL_VERTEX_SHADER);
 	v_code =
-		"#version 330\n"
-
-		"layout(location = 0) in vec2 v_position;\n"
+		// Two vertices per instance, the line's endpoints
+		"uniform vec4 transform;\n"
 
-		"out vec2 f_uv;\n"
+		"flat out vec3 f_color;\n"
 
 		"void main()\n"
 		"{\n"
-			"gl_Position = vec4(v_position, 0.0f, 1.0f);\n"
+			"vec2 start, end;\n"
+			"float radius;\n"
+			"fetch_line(start, end, radius, f_color);\n"
+			"gl_Position = vec4((gl_VertexID == 0 ? start : end) * transform.xy + transform.zw, 0.0f, 1.0f);\n"
 		"}";
-	glShaderSource(vertexShader, 1, &v_code, 0);
+	const GLchar* batch_simple_vertex[] = { batch_common, v_code };
+	glShaderSource(vertexShader, 2, batch_simple_vertex, 0);
 	glCompileShader(vertexShader);
-	check_shader_compiled(vertexShader, "vertexLine");
+	check_shader_compiled(vertexShader, "batchLineVertex");
 
 	fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 	f_code =
 		"#version 330\n"
 
-		"in vec2 f_uv;\n"
-
-		"uniform vec3 color;\n"
+		"flat in vec3 f_color;\n"
 
 		"out vec4 out_color;\n"
 		"void main()\n"
 		"{\n"
-			"out_color = vec4(color, 1.0f);\n"
+			"out_color = vec4(f_color, 1.0f);\n"
 		"}";
 	glShaderSource(fragmentShader, 1, &f_code, 0);
 	glCompileShader(fragmentShader);
-	check_shader_compiled(fragmentShader, "framgentLine");
-
-	mProgramSimple = glCreateProgram();
-	glAttachShader(mProgramSimple, vertexShader);
-	glAttachShader(mProgramSimple, fragmentShader);
-	glLinkProgram(mProgramSimple);
-	check_program_linked(mProgramSimple, "SDFProgram");
-	glDetachShader(mProgramSimple, fragmentShader);
-	glDetachShader(mProgramSimple, vertexShader);
+	check_shader_compiled(fragmentShader, "batchLineFragment");
 
-	// Release resources we no longer need
+	mProgramBatchSimple = glCreateProgram();
+	glAttachShader(mProgramBatchSimple, vertexShader);
+	glAttachShader(mProgramBatchSimple, fragmentShader);
+	glLinkProgram(mProgramBatchSimple);
+	check_program_linked(mProgramBatchSimple, "BatchLineProgram");
+	glDetachShader(mProgramBatchSimple, fragmentShader);
+	glDetachShader(mProgramBatchSimple, vertexShader);
 	glDeleteShader(fragmentShader);
 	glDeleteShader(vertexShader);
 }
@@ -301,38 +1851,327 @@ void Renderer::check_program_linked(int program, const char* program_name)
 
 void Renderer::assign_random_color()
 {
-	mR = static_cast<float>(rand()) / RAND_MAX;
-	mG = static_cast<float>(rand()) / RAND_MAX;
-	mB = static_cast<float>(rand()) / RAND_MAX;
+	// Stored as RGBA8 so the preview matches the committed line exactly
+	mColor = static_cast<unsigned int>(rand() & 0xff) | (static_cast<unsigned int>(rand() & 0xff) << 8) |
+		(static_cast<unsigned int>(rand() & 0xff) << 16) | 0xff000000u;
+}
+
+void Renderer::set_target(GLuint framebuffer, float origin_x, float origin_y, float scale, int width, int height)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+	mTargetOriginX = origin_x;
+	mTargetOriginY = origin_y;
+	mTargetScale = scale;
+	mTargetWidth = width;
+	mTargetHeight = height;
+}
+
+void Renderer::set_window_target()
+{
+	set_target(0u, mCameraX - mHalfWidth / mZoom, mCameraY - mHalfHeight / mZoom, 1.0f / mZoom, mWidth, mHeight);
+}
+
+Line Renderer::current_line() const
+{
+	Line line;
+	line.start_x = static_cast<float>(mStartX);
+	line.start_y = static_cast<float>(mStartY);
+	line.end_x = static_cast<float>(mEndX);
+	line.end_y = static_cast<float>(mEndY);
+	line.radius = mLineSimple ? 0.0f : mRadius;
+	line.color = mColor;
+	return line;
 }
 
-void Renderer::render_line()
+void Renderer::render_line(const Line& line)
 {
-	if (mLineSimple)
+	float r = (line.color & 0xff) / 255.0f;
+	float g = ((line.color >> 8) & 0xff) / 255.0f;
+	float b = ((line.color >> 16) & 0xff) / 255.0f;
+
+	// Coverage only canvas, the preview matches what gets committed
+	if (mCanvas.format() == CanvasFormat::R8)
+		r = g = b = 1.0f;
+	if (line.radius <= 0.0f)
 	{
 		glUseProgram(mProgramSimple);
 		bind_line();
-		float line[] =
-		{
-			static_cast<float>(mStartX) / mHalfWidth, static_cast<float>(mStartY) / mHalfHeight,
-			static_cast<float>(mEndX) / mHalfWidth, static_cast<float>(mEndY) / mHalfHeight
-		};
-		glBufferData(GL_ARRAY_BUFFER, sizeof(line), line, GL_DYNAMIC_DRAW);
-		glUniform3f(glGetUniformLocation(mProgramSimple, "color"), mR, mG, mB);
+		float vertices[] = { line.start_x, line.start_y, line.end_x, line.end_y };
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
+		float scale_x = 2.0f / (mTargetWidth * mTargetScale);
+		float scale_y = 2.0f / (mTargetHeight * mTargetScale);
+		glUniform4f(glGetUniformLocation(mProgramSimple, "transform"),
+			scale_x, scale_y, -mTargetOriginX * scale_x - 1.0f, -mTargetOriginY * scale_y - 1.0f);
+		glUniform3f(glGetUniformLocation(mProgramSimple, "color"), r, g, b);
 		glDrawArrays(GL_LINES, 0, 2);
 	}
 	else
 	{
 		glUseProgram(mProgramSDF);
 		bind_plane();
-		glUniform2i(glGetUniformLocation(mProgramSDF, "start"), mStartX, mStartY);
-		glUniform2i(glGetUniformLocation(mProgramSDF, "end"), mEndX, mEndY);
-		glUniform3f(glGetUniformLocation(mProgramSDF, "color"), mR, mG, mB);
-		glUniform1f(glGetUniformLocation(mProgramSDF, "radius"), mRadius);
+		glUniform4f(glGetUniformLocation(mProgramSDF, "transform"), 1.0f, 1.0f, 0.0f, 0.0f);
+		glUniform2f(glGetUniformLocation(mProgramSDF, "origin"), mTargetOriginX, mTargetOriginY);
+		glUniform1f(glGetUniformLocation(mProgramSDF, "scale"), mTargetScale);
+		glUniform2f(glGetUniformLocation(mProgramSDF, "start"), line.start_x, line.start_y);
+		glUniform2f(glGetUniformLocation(mProgramSDF, "end"), line.end_x, line.end_y);
+		glUniform3f(glGetUniformLocation(mProgramSDF, "color"), r, g, b);
+		glUniform1f(glGetUniformLocation(mProgramSDF, "radius"), line.radius);
+		glUniform1f(glGetUniformLocation(mProgramSDF, "fade"), kSDFFade * mTargetScale);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 	}
 }
 
+void Renderer::render_lines(const size_t* ids, size_t count)
+{
+	// Short lists aren't worth the setup, and the line buffer has a size limit
+	if (count < kMinBatchLines || !sync_line_buffer(mLines.size()))
+	{
+		for (size_t i = 0; i < count; ++i)
+			if (!mLines.is_removed(ids[i]))
+				render_line(mLines.get(ids[i]));
+		return;
+	}
+
+	mBatchIds.clear();
+	for (size_t i = 0; i < count; ++i)
+		if (!mLines.is_removed(ids[i]))
+			mBatchIds.push_back(static_cast<unsigned int>(ids[i]));
+	if (mBatchIds.empty())
+		return;
+	glBindBuffer(GL_ARRAY_BUFFER, mIdBuffer);
+	glBufferData(GL_ARRAY_BUFFER, mBatchIds.size() * sizeof(unsigned int), mBatchIds.data(), GL_STREAM_DRAW);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, mLineTexture);
+
+	// Runs of the same kind of line share a draw, so the submission order is kept
+	float scale_x = 2.0f / (mTargetWidth * mTargetScale);
+	float scale_y = 2.0f / (mTargetHeight * mTargetScale);
+	bool coverage_only = mCanvas.format() == CanvasFormat::R8;
+	size_t first = 0u;
+	while (first < mBatchIds.size())
+	{
+		bool simple = mLines.get(mBatchIds[first]).radius <= 0.0f;
+		size_t last = first + 1u;
+		while (last < mBatchIds.size() && (mLines.get(mBatchIds[last]).radius <= 0.0f) == simple)
+			++last;
+
+		GLuint program = simple ? mProgramBatchSimple : mProgramBatchSDF;
+		glUseProgram(program);
+		glUniform1i(glGetUniformLocation(program, "lines"), 0);
+		glUniform1i(glGetUniformLocation(program, "coverage_only"), coverage_only);
+		if (simple)
+		{
+			glUniform4f(glGetUniformLocation(program, "transform"),
+				scale_x, scale_y, -mTargetOriginX * scale_x - 1.0f, -mTargetOriginY * scale_y - 1.0f);
+		}
+		else
+		{
+			bind_plane();
+			glUniform2f(glGetUniformLocation(program, "origin"), mTargetOriginX, mTargetOriginY);
+			glUniform1f(glGetUniformLocation(program, "scale"), mTargetScale);
+			glUniform2f(glGetUniformLocation(program, "size"), static_cast<float>(mTargetWidth), static_cast<float>(mTargetHeight));
+			glUniform1f(glGetUniformLocation(program, "fade"), kSDFFade * mTargetScale);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, mIdBuffer);
+		glEnableVertexAttribArray(2);
+		glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, 0, (void*)(first * sizeof(unsigned int)));
+		glVertexAttribDivisor(2, 1);
+		if (simple)
+			glDrawArraysInstanced(GL_LINES, 0, 2, static_cast<GLsizei>(last - first));
+		else
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(last - first));
+		first = last;
+	}
+	glVertexAttribDivisor(2, 0);
+	glDisableVertexAttribArray(2);
+}
+
+bool Renderer::sync_line_buffer(size_t count)
+{
+	if (count > mMaxBatchLines)
+		return false;
+
+	// Lines never change once added, so only the new ones are uploaded. Growing doubles
+	// the storage and copies what is already there on the GPU
+	if (count > mLineBufferCapacity)
+	{
+		size_t capacity = mLineBufferCapacity > 0u ? mLineBufferCapacity : 4096u;
+		while (capacity < count)
+			capacity *= 2u;
+		capacity = capacity < mMaxBatchLines ? capacity : mMaxBatchLines;
+
+		GLuint buffer = 0u;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, capacity * sizeof(Line), nullptr, GL_STATIC_DRAW);
+		if (mLineBuffer)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, mLineBuffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, mUploadedLines * sizeof(Line));
+			glDeleteBuffers(1, &mLineBuffer);
+		}
+		mLineBuffer = buffer;
+		mLineBufferCapacity = capacity;
+		glBindTexture(GL_TEXTURE_BUFFER, mLineTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, mLineBuffer);
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, mLineBuffer);
+	while (mUploadedLines < count)
+	{
+		size_t run = 0u;
+		const Line* lines = mLines.contiguous(mUploadedLines, run, mUploadScratch);
+		run = run < count - mUploadedLines ? run : count - mUploadedLines;
+		glBufferSubData(GL_COPY_WRITE_BUFFER, mUploadedLines * sizeof(Line), run * sizeof(Line), lines);
+		mUploadedLines += run;
+	}
+	return true;
+}
+
+void Renderer::commit_line(const Line& line)
+{
+	// Only tiles the line actually reaches are allocated and drawn to
+	float padding = line_padding(line);
+	int min_x = Canvas::tile_coordinate(0, (line.start_x < line.end_x ? line.start_x : line.end_x) - padding);
+	int max_x = Canvas::tile_coordinate(0, (line.start_x < line.end_x ? line.end_x : line.start_x) + padding);
+	int min_y = Canvas::tile_coordinate(0, (line.start_y < line.end_y ? line.start_y : line.end_y) - padding);
+	int max_y = Canvas::tile_coordinate(0, (line.start_y < line.end_y ? line.end_y : line.start_y) + padding);
+	const float size = static_cast<float>(Canvas::kTileSize);
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			float origin_x = x * size, origin_y = y * size;
+			if (!segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, padding, origin_x, origin_y, origin_x + size, origin_y + size))
+				continue;
+
+			if (mRecording)
+				mHistory.snapshot(*mRecording, mCanvas, x, y);
+			before_tile_change(x, y);
+			Tile& tile = mCanvas.acquire_tile(0, x, y);
+			mCanvas.mark_ancestors_dirty(x, y);
+			if (mMsaaSamples > 0)
+			{
+				seed_scratch_tile(tile, origin_x, origin_y);
+				render_line(line);
+				resolve_line(line, mMsaaFramebuffer, tile.framebuffer);
+			}
+			else
+			{
+				set_target(tile.framebuffer, origin_x, origin_y, 1.0f, Canvas::kTileSize, Canvas::kTileSize);
+				render_line(line);
+			}
+		}
+	}
+
+	// Finished detail tiles get the line on top, one still being rasterized reaches it on its own
+	for (const DetailTile& detail : mDetailTiles)
+	{
+		Tile* tile = mCanvas.find_tile(detail.level, detail.x, detail.y);
+		if (!tile || tile->dirty)
+			continue;
+
+		float span = Canvas::tile_span(detail.level);
+		float origin_x = detail.x * span, origin_y = detail.y * span;
+		if (!segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, padding, origin_x, origin_y, origin_x + span, origin_y + span))
+			continue;
+
+		set_target(tile->framebuffer, origin_x, origin_y, span / Canvas::kTileSize, Canvas::kTileSize, Canvas::kTileSize);
+		render_line(line);
+	}
+	set_window_target();
+}
+
+void Renderer::commit_lines(size_t first, size_t count)
+{
+	// Group the lines by the level 0 tiles they reach, then draw each group in one go
+	const float size = static_cast<float>(Canvas::kTileSize);
+	std::unordered_map<long long, std::vector<size_t>> tiles;
+	Region bounds = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (size_t id = first; id < first + count; ++id)
+	{
+		const Line& line = mLines.get(id);
+		float padding = line_padding(line);
+		Region bound = {
+			(line.start_x < line.end_x ? line.start_x : line.end_x) - padding,
+			(line.start_y < line.end_y ? line.start_y : line.end_y) - padding,
+			(line.start_x < line.end_x ? line.end_x : line.start_x) + padding,
+			(line.start_y < line.end_y ? line.end_y : line.start_y) + padding };
+		bounds.min_x = bound.min_x < bounds.min_x ? bound.min_x : bounds.min_x;
+		bounds.min_y = bound.min_y < bounds.min_y ? bound.min_y : bounds.min_y;
+		bounds.max_x = bound.max_x > bounds.max_x ? bound.max_x : bounds.max_x;
+		bounds.max_y = bound.max_y > bounds.max_y ? bound.max_y : bounds.max_y;
+
+		int min_x = Canvas::tile_coordinate(0, bound.min_x), max_x = Canvas::tile_coordinate(0, bound.max_x);
+		int min_y = Canvas::tile_coordinate(0, bound.min_y), max_y = Canvas::tile_coordinate(0, bound.max_y);
+		for (int y = min_y; y <= max_y; ++y)
+		{
+			for (int x = min_x; x <= max_x; ++x)
+			{
+				float origin_x = x * size, origin_y = y * size;
+				if (segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, padding, origin_x, origin_y, origin_x + size, origin_y + size))
+					tiles[(static_cast<long long>(x) << 32) | static_cast<unsigned int>(y)].push_back(id);
+			}
+		}
+	}
+
+	for (const auto& entry : tiles)
+	{
+		int x = static_cast<int>(entry.first >> 32);
+		int y = static_cast<int>(entry.first & 0xffffffff);
+		float origin_x = x * size, origin_y = y * size;
+		before_tile_change(x, y);
+		Tile& tile = mCanvas.acquire_tile(0, x, y);
+		mCanvas.mark_ancestors_dirty(x, y);
+		// Imported lines aren't part of any undoable action, snapshots of the tile would
+		// take them away again
+		mHistory.invalidate_tile(x, y);
+		if (mMsaaSamples > 0)
+		{
+			seed_scratch_tile(tile, origin_x, origin_y);
+			render_lines(entry.second.data(), entry.second.size());
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, mMsaaFramebuffer);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, tile.framebuffer);
+			glBlitFramebuffer(0, 0, Canvas::kTileSize, Canvas::kTileSize, 0, 0, Canvas::kTileSize, Canvas::kTileSize, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
+		else
+		{
+			set_target(tile.framebuffer, origin_x, origin_y, 1.0f, Canvas::kTileSize, Canvas::kTileSize);
+			render_lines(entry.second.data(), entry.second.size());
+		}
+	}
+
+	// Detail tiles under the batch are rebuilt rather than patched line by line
+	for (const DetailTile& detail : mDetailTiles)
+	{
+		float span = Canvas::tile_span(detail.level);
+		if ((detail.x + 1) * span < bounds.min_x || detail.x * span > bounds.max_x || (detail.y + 1) * span < bounds.min_y || detail.y * span > bounds.max_y)
+			continue;
+		Tile* tile = mCanvas.find_tile(detail.level, detail.x, detail.y);
+		if (tile)
+			tile->dirty = true;
+		if (mJobActive && mJobLevel == detail.level && mJobX == detail.x && mJobY == detail.y)
+			mJobActive = false;
+	}
+	set_window_target();
+}
+
+void Renderer::seed_scratch_tile(const Tile& tile, float origin_x, float origin_y)
+{
+	// Seed the scratch tile with the current contents, blits can't write to it
+	set_target(mMsaaFramebuffer, origin_x, origin_y, 1.0f, Canvas::kTileSize, Canvas::kTileSize);
+	glDisable(GL_BLEND);
+	glUseProgram(mProgramToDisplay);
+	bind_plane();
+	glUniform4f(glGetUniformLocation(mProgramToDisplay, "transform"), 1.0f, 1.0f, 0.0f, 0.0f);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, tile.texture);
+	glUniform1i(glGetUniformLocation(mProgramToDisplay, "image"), 0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glEnable(GL_BLEND);
+}
+
 void Renderer::bind_plane()
 {
 	glBindBuffer(GL_ARRAY_BUFFER, mPlane);
@@ -348,3 +2187,513 @@ void Renderer::bind_line()
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
 }
+
+void Renderer::composite(CompositeMode mode)
+{
+	// Coarsest pyramid level that still has a texel per window pixel, so the number of
+	// visible tiles stays the same whatever the zoom
+	int level = 0;
+	while (level + 1 < Canvas::kLevelCount && static_cast<float>(2 << level) * mZoom <= 1.0f)
+		++level;
+
+	// Bring visible tiles up to date first, downsampling changes the bound framebuffer
+	std::vector<VisibleTile> visible;
+	mDownsampleBudget = kDownsampleBudget;
+	int min_x, min_y, max_x, max_y;
+	visible_tiles(level, min_x, min_y, max_x, max_y);
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			Tile* tile = level == 0 ? mCanvas.find_tile(0, x, y) : update_pyramid_tile(level, x, y);
+			if (tile && tile->framebuffer)
+				visible.push_back({ tile, x, y });
+		}
+	}
+
+	// Tiles that were never drawn to are not allocated, they show the clear color
+	set_window_target();
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	// Scaled up level 0 first, then the sharp detail tiles that are ready on top. Tiles
+	// are opaque and replace what is below, which max blending would not do
+	glDisable(GL_BLEND);
+	draw_tiles(mode, level, visible);
+	if (mDetailLevel < 0)
+		draw_tiles(mode, mDetailLevel, mReadyDetailTiles);
+	glEnable(GL_BLEND);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0u);
+}
+
+void Renderer::draw_tiles(CompositeMode mode, int level, const std::vector<VisibleTile>& tiles)
+{
+	if (mode == CompositeMode::Draw)
+	{
+		glUseProgram(mProgramToDisplay);
+		bind_plane();
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(glGetUniformLocation(mProgramToDisplay, "image"), 0);
+	}
+
+	const int size = Canvas::kTileSize;
+	float span = Canvas::tile_span(level);
+	for (const VisibleTile& visible_tile : tiles)
+	{
+		// Window position of the tile's corners
+		float left = (visible_tile.x * span - mCameraX) * mZoom + mHalfWidth;
+		float bottom = (visible_tile.y * span - mCameraY) * mZoom + mHalfHeight;
+		float extent = span * mZoom;
+		if (mode == CompositeMode::Blit)
+		{
+			// Round each edge on its own so neighbouring tiles share it
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, visible_tile.tile->framebuffer);
+			glBlitFramebuffer(0, 0, size, size,
+				static_cast<GLint>(floorf(left + 0.5f)), static_cast<GLint>(floorf(bottom + 0.5f)),
+				static_cast<GLint>(floorf(left + extent + 0.5f)), static_cast<GLint>(floorf(bottom + extent + 0.5f)),
+				GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		}
+		else
+		{
+			float scale_x = extent / mWidth;
+			float scale_y = extent / mHeight;
+			glUniform4f(glGetUniformLocation(mProgramToDisplay, "transform"),
+				scale_x, scale_y, left * 2.0f / mWidth - 1.0f + scale_x, bottom * 2.0f / mHeight - 1.0f + scale_y);
+			glBindTexture(GL_TEXTURE_2D, visible_tile.tile->texture);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		}
+	}
+}
+
+void Renderer::update_detail_tiles()
+{
+	// Finest level whose texels are no bigger than a window pixel, none at zoom 1 or below
+	mReadyDetailTiles.clear();
+	mDetailLevel = 0;
+	while (mDetailLevel > -Canvas::kDetailLevelCount && ldexpf(1.0f, mDetailLevel) * mZoom > 1.0f)
+		--mDetailLevel;
+	// Canvas tiles of an opened document come first
+	if (mDetailLevel == 0 || mLoading)
+	{
+		mDetailLevel = 0;
+		mJobActive = false;
+		return;
+	}
+
+	// Split visible tiles into ready ones and ones still to rasterize, nearest first
+	struct Pending
+	{
+		int x, y;
+	};
+	std::vector<Pending> pending;
+	int min_x, min_y, max_x, max_y;
+	visible_tiles(mDetailLevel, min_x, min_y, max_x, max_y);
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			Tile* tile = mCanvas.find_tile(mDetailLevel, x, y);
+			if (tile && !tile->dirty)
+			{
+				mReadyDetailTiles.push_back({ tile, x, y });
+				for (DetailTile& detail : mDetailTiles)
+					if (detail.level == mDetailLevel && detail.x == x && detail.y == y)
+						detail.last_used = mFrameIndex;
+			}
+			else
+				pending.push_back({ x, y });
+		}
+	}
+
+	// Keep going with the current job while it is visible, otherwise start on the next one
+	auto start = std::chrono::high_resolution_clock::now();
+	float texel = ldexpf(1.0f, mDetailLevel);
+	while (!pending.empty())
+	{
+		// A job of another level is left behind, zooming made it invisible
+		size_t index = mJobLevel == mDetailLevel ? 0u : pending.size();
+		if (mJobActive)
+			while (index < pending.size() && (pending[index].x != mJobX || pending[index].y != mJobY))
+				++index;
+		if (!mJobActive || index == pending.size())
+		{
+			index = 0u;
+			mJobActive = true;
+			mJobLevel = mDetailLevel;
+			mJobX = pending[0].x;
+			mJobY = pending[0].y;
+			mJobNextLine = 0u;
+			acquire_detail_tile(mJobLevel, mJobX, mJobY).dirty = true;
+
+			// Only lines reaching the tile, grown by a texel for the filtering
+			float span = Canvas::tile_span(mJobLevel);
+			float origin_x = mJobX * span, origin_y = mJobY * span;
+			mIndex.query_region(mLines, origin_x - texel, origin_y - texel, origin_x + span + texel, origin_y + span + texel, mJobLines);
+		}
+
+		// Replay the lines touching the tile in submission order
+		Tile* tile = mCanvas.find_tile(mJobLevel, mJobX, mJobY);
+		float span = Canvas::tile_span(mJobLevel);
+		float origin_x = mJobX * span, origin_y = mJobY * span;
+		set_target(tile->framebuffer, origin_x, origin_y, span / Canvas::kTileSize, Canvas::kTileSize, Canvas::kTileSize);
+		if (mJobNextLine == 0u)
+		{
+			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+		bool out_of_time = false;
+		while (mJobNextLine < mJobLines.size() && !out_of_time)
+		{
+			size_t end = mJobNextLine + kDetailLineChunk;
+			end = end < mJobLines.size() ? end : mJobLines.size();
+			render_lines(&mJobLines[mJobNextLine], end - mJobNextLine);
+			mJobNextLine = end;
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+			out_of_time = elapsed.count() >= kDetailTimeBudget;
+		}
+		if (mJobNextLine < mJobLines.size())
+			break;
+
+		// Done, it can be shown from now on
+		tile->dirty = false;
+		mJobActive = false;
+		if (mJobLevel != mDetailLevel)
+			continue;
+		mReadyDetailTiles.push_back({ tile, mJobX, mJobY });
+		pending.erase(pending.begin() + index);
+
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		if (elapsed.count() >= kDetailTimeBudget)
+			break;
+	}
+	if (!pending.empty())
+		mPendingWork = true;
+}
+
+Tile& Renderer::acquire_detail_tile(int level, int x, int y)
+{
+	// A job abandoned part way through left its tile behind, start it over
+	for (DetailTile& detail : mDetailTiles)
+	{
+		if (detail.level == level && detail.x == x && detail.y == y)
+		{
+			detail.last_used = mFrameIndex;
+			return mCanvas.acquire_tile(level, x, y);
+		}
+	}
+
+	// Make room by dropping the least recently shown detail tile
+	if (mDetailTiles.size() >= kMaxDetailTiles)
+	{
+		size_t oldest = 0u;
+		for (size_t i = 1u; i < mDetailTiles.size(); ++i)
+			if (mDetailTiles[i].last_used < mDetailTiles[oldest].last_used)
+				oldest = i;
+		mCanvas.release_tile(mDetailTiles[oldest].level, mDetailTiles[oldest].x, mDetailTiles[oldest].y);
+		mDetailTiles[oldest] = mDetailTiles.back();
+		mDetailTiles.pop_back();
+	}
+
+	mDetailTiles.push_back({ level, x, y, mFrameIndex });
+	return mCanvas.acquire_tile(level, x, y);
+}
+
+void Renderer::redraw_lines(const std::vector<size_t>& lines, bool canvas_tiles)
+{
+	// Gather the area each line covers per level 0 tile it reaches, so a long line only
+	// costs the strip of tiles along it
+	auto grow = [](Region& region, const Region& other)
+	{
+		region.min_x = other.min_x < region.min_x ? other.min_x : region.min_x;
+		region.min_y = other.min_y < region.min_y ? other.min_y : region.min_y;
+		region.max_x = other.max_x > region.max_x ? other.max_x : region.max_x;
+		region.max_y = other.max_y > region.max_y ? other.max_y : region.max_y;
+	};
+	std::unordered_map<long long, Region> tiles;
+	std::vector<Region> bounds;
+	const float size = static_cast<float>(Canvas::kTileSize);
+	for (size_t id : lines)
+	{
+		const Line& line = mLines.get(id);
+		float padding = line_padding(line);
+		Region bound = {
+			(line.start_x < line.end_x ? line.start_x : line.end_x) - padding,
+			(line.start_y < line.end_y ? line.start_y : line.end_y) - padding,
+			(line.start_x < line.end_x ? line.end_x : line.start_x) + padding,
+			(line.start_y < line.end_y ? line.end_y : line.start_y) + padding };
+		bounds.push_back(bound);
+
+		int min_x = Canvas::tile_coordinate(0, bound.min_x), max_x = Canvas::tile_coordinate(0, bound.max_x);
+		int min_y = Canvas::tile_coordinate(0, bound.min_y), max_y = Canvas::tile_coordinate(0, bound.max_y);
+		for (int y = min_y; y <= max_y; ++y)
+		{
+			for (int x = min_x; x <= max_x; ++x)
+			{
+				float origin_x = x * size, origin_y = y * size;
+				if (!segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, padding, origin_x, origin_y, origin_x + size, origin_y + size))
+					continue;
+
+				long long key = (static_cast<long long>(x) << 32) | static_cast<unsigned int>(y);
+				auto it = tiles.find(key);
+				if (it == tiles.end())
+					tiles[key] = bound;
+				else
+					grow(it->second, bound);
+			}
+		}
+	}
+
+	for (const auto& entry : tiles)
+	{
+		if (!canvas_tiles)
+			break;
+
+		// Lines put back by a replayed redo may reach tiles the undo released
+		int x = static_cast<int>(entry.first >> 32);
+		int y = static_cast<int>(entry.first & 0xffffffff);
+		Tile* tile = mCanvas.find_tile(0, x, y);
+		if ((!tile || !tile->framebuffer) && mLines.is_removed(lines.front()))
+			continue;
+		if (mRecording)
+			mHistory.snapshot(*mRecording, mCanvas, x, y);
+		before_tile_change(x, y);
+		tile = &mCanvas.acquire_tile(0, x, y);
+		redraw_tile_region(*tile, 0, x, y, entry.second, mMsaaSamples > 0);
+		mCanvas.mark_ancestors_dirty(x, y);
+	}
+
+	// Finished detail tiles are patched the same way, the one being rasterized starts over
+	for (const DetailTile& detail : mDetailTiles)
+	{
+		Tile* tile = mCanvas.find_tile(detail.level, detail.x, detail.y);
+		if (!tile)
+			continue;
+
+		float span = Canvas::tile_span(detail.level);
+		Region tile_region = { detail.x * span, detail.y * span, (detail.x + 1) * span, (detail.y + 1) * span };
+		bool touched = false;
+		Region region = tile_region;
+		for (const Region& bound : bounds)
+		{
+			if (bound.max_x < tile_region.min_x || bound.min_x > tile_region.max_x || bound.max_y < tile_region.min_y || bound.min_y > tile_region.max_y)
+				continue;
+			if (!touched)
+				region = bound;
+			else
+				grow(region, bound);
+			touched = true;
+		}
+		if (!touched)
+			continue;
+
+		if (!tile->dirty)
+			redraw_tile_region(*tile, detail.level, detail.x, detail.y, region, false);
+		else if (mJobActive && mJobLevel == detail.level && mJobX == detail.x && mJobY == detail.y)
+			mJobActive = false;
+	}
+	set_window_target();
+}
+
+void Renderer::redraw_tile_region(Tile& tile, int level, int x, int y, const Region& region, bool multisampled)
+{
+	// Whole tile pixels covering the region
+	float span = Canvas::tile_span(level);
+	float scale = span / Canvas::kTileSize;
+	float origin_x = x * span, origin_y = y * span;
+	int x0 = static_cast<int>(floorf((region.min_x - origin_x) / scale));
+	int y0 = static_cast<int>(floorf((region.min_y - origin_y) / scale));
+	int x1 = static_cast<int>(ceilf((region.max_x - origin_x) / scale));
+	int y1 = static_cast<int>(ceilf((region.max_y - origin_y) / scale));
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 > Canvas::kTileSize ? Canvas::kTileSize : x1;
+	y1 = y1 > Canvas::kTileSize ? Canvas::kTileSize : y1;
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	// Every line left that reaches those pixels, in submission order
+	mIndex.query_region(mLines, origin_x + x0 * scale, origin_y + y0 * scale, origin_x + x1 * scale, origin_y + y1 * scale, mRedrawLines);
+
+	// Only the scissored area is cleared and resolved, so the scratch tile needs no seeding
+	set_target(multisampled ? mMsaaFramebuffer : tile.framebuffer, origin_x, origin_y, scale, Canvas::kTileSize, Canvas::kTileSize);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(x0, y0, x1 - x0, y1 - y0);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	render_lines(mRedrawLines.data(), mRedrawLines.size());
+	if (multisampled)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, mMsaaFramebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, tile.framebuffer);
+		glBlitFramebuffer(x0, y0, x1, y1, x0, y0, x1, y1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	glDisable(GL_SCISSOR_TEST);
+}
+
+Tile* Renderer::update_pyramid_tile(int level, int x, int y)
+{
+	// No entry means nothing was ever drawn below this tile
+	Tile* tile = mCanvas.find_tile(level, x, y);
+	if (!tile || !tile->dirty)
+		return tile;
+
+	// Children have to be current before they can be downsampled
+	Tile* children[4];
+	bool children_ready = true;
+	for (int i = 0; i < 4; ++i)
+	{
+		int child_x = x * 2 + (i & 1);
+		int child_y = y * 2 + (i >> 1);
+		children[i] = level == 1 ? mCanvas.find_tile(0, child_x, child_y) : update_pyramid_tile(level - 1, child_x, child_y);
+		if (children[i] && children[i]->dirty)
+			children_ready = false;
+	}
+
+	// Out of budget, show whatever the tile had until a later frame gets to it
+	if (!children_ready || mDownsampleBudget <= 0)
+	{
+		mPendingWork = true;
+		return tile;
+	}
+	--mDownsampleBudget;
+
+	// Each child lands on a quadrant, linear filtering averages 2x2 texels
+	Tile& parent = mCanvas.acquire_tile(level, x, y);
+	set_target(parent.framebuffer, x * Canvas::tile_span(level), y * Canvas::tile_span(level),
+		static_cast<float>(1 << level), Canvas::kTileSize, Canvas::kTileSize);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_BLEND);
+	glUseProgram(mProgramToDisplay);
+	bind_plane();
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(glGetUniformLocation(mProgramToDisplay, "image"), 0);
+	for (int i = 0; i < 4; ++i)
+	{
+		if (!children[i] || !children[i]->texture)
+			continue;
+		glUniform4f(glGetUniformLocation(mProgramToDisplay, "transform"),
+			0.5f, 0.5f, (i & 1) ? 0.5f : -0.5f, (i >> 1) ? 0.5f : -0.5f);
+		glBindTexture(GL_TEXTURE_2D, children[i]->texture);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	glEnable(GL_BLEND);
+	parent.dirty = false;
+	return &parent;
+}
+
+void Renderer::select_composite_mode()
+{
+	// The canvas is still empty, fill the window with tiles so there is something to copy
+	int min_x, min_y, max_x, max_y;
+	visible_tiles(0, min_x, min_y, max_x, max_y);
+	for (int y = min_y; y <= max_y; ++y)
+		for (int x = min_x; x <= max_x; ++x)
+			mCanvas.acquire_tile(0, x, y);
+
+	// Drivers differ on which path is cheaper, so time each one and keep the fastest.
+	// Blits ignore the swizzle that turns R8 coverage gray, so those can only draw
+	const CompositeMode modes[] = { CompositeMode::Draw, CompositeMode::Blit };
+	const char* mode_names[] = { "draw", "blit" };
+	const int mode_count = mCanvas.format() == CanvasFormat::R8 ? 1 : sizeof(modes) / sizeof(CompositeMode);
+	double best_time = 0.0;
+	for (int i = 0; i < mode_count; ++i)
+	{
+		// Warm up so lazily created driver state is not part of the timing
+		for (int j = 0; j < kCompositeBenchmarkWarmup; ++j)
+			composite(modes[i]);
+		glFinish();
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int j = 0; j < kCompositeBenchmarkIterations; ++j)
+			composite(modes[i]);
+		glFinish();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		double time = elapsed.count() / kCompositeBenchmarkIterations;
+		fprintf(stdout, "Composite %s: %.3f ms\n", mode_names[i], time);
+		if (i == 0 || time < best_time)
+		{
+			best_time = time;
+			mCompositeMode = modes[i];
+		}
+	}
+	fprintf(stdout, "Using %s composite\n", mode_names[static_cast<int>(mCompositeMode)]);
+
+	for (int y = min_y; y <= max_y; ++y)
+		for (int x = min_x; x <= max_x; ++x)
+			mCanvas.release_tile(0, x, y);
+}
+
+void Renderer::retire_frames(bool wait)
+{
+	while (mFramesInFlight > 0)
+	{
+		// Flush on the blocking wait, the fence may not have reached the GPU yet
+		GLsync fence = mFrameFences[mOldestFrame];
+		GLenum result = wait ? glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) : glClientWaitSync(fence, 0, 0);
+		if (result == GL_TIMEOUT_EXPIRED)
+			return;
+
+		// The GPU timestamp tells when the frame completed even if we poll much later
+		if (mFrameHasInput[mOldestFrame])
+		{
+			GLint64 gpu_time = 0;
+			glGetQueryObjecti64v(mFrameQueries[mOldestFrame], GL_QUERY_RESULT, &gpu_time);
+			long long input_time = std::chrono::duration_cast<std::chrono::nanoseconds>(mFrameInputTimes[mOldestFrame].time_since_epoch()).count();
+			mLatency.add_sample(static_cast<double>(gpu_time + mGpuClockOffset - input_time) * 1e-6);
+			mFrameHasInput[mOldestFrame] = false;
+		}
+
+		glDeleteSync(fence);
+		mFrameFences[mOldestFrame] = 0;
+		mOldestFrame = (mOldestFrame + 1) % kMaxFramesInFlight;
+		--mFramesInFlight;
+
+		// Only wait for a single frame, the rest are polled
+		wait = false;
+	}
+}
+
+void Renderer::calibrate_gpu_clock()
+{
+	// Sample both clocks back to back, the GL timestamp is read without waiting for the GPU
+	GLint64 gpu_time = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpu_time);
+	long long cpu_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	mGpuClockOffset = cpu_time - gpu_time;
+}
+
+void Renderer::resolve_line(const Line& line, GLuint source, GLuint destination)
+{
+	// Only the area around the line changed, in pixels of the current target
+	float padding = line_padding(line) + 1.0f;
+	int x0 = static_cast<int>(floorf((line.start_x < line.end_x ? line.start_x : line.end_x) - mTargetOriginX - padding));
+	int x1 = static_cast<int>(ceilf((line.start_x < line.end_x ? line.end_x : line.start_x) - mTargetOriginX + padding));
+	int y0 = static_cast<int>(floorf((line.start_y < line.end_y ? line.start_y : line.end_y) - mTargetOriginY - padding));
+	int y1 = static_cast<int>(ceilf((line.start_y < line.end_y ? line.end_y : line.start_y) - mTargetOriginY + padding));
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 > mTargetWidth ? mTargetWidth : x1;
+	y1 = y1 > mTargetHeight ? mTargetHeight : y1;
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, destination);
+	glBlitFramebuffer(x0, y0, x1, y1, x0, y0, x1, y1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void Renderer::visible_tiles(int level, int& min_x, int& min_y, int& max_x, int& max_y) const
+{
+	min_x = Canvas::tile_coordinate(level, mCameraX - mHalfWidth / mZoom);
+	max_x = Canvas::tile_coordinate(level, mCameraX + mHalfWidth / mZoom);
+	min_y = Canvas::tile_coordinate(level, mCameraY - mHalfHeight / mZoom);
+	max_y = Canvas::tile_coordinate(level, mCameraY + mHalfHeight / mZoom);
+}
+
+float Renderer::line_padding(const Line& line)
+{
+	// Distance from the segment that can still get coverage
+	return line.radius <= 0.0f ? 1.0f : line.radius + kSDFFade + 1.0f;
+}
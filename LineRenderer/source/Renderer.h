@@ -1,58 +1,441 @@
 #pragma once
 
+#include "AsyncReadback.h"
+#include "Canvas.h"
+#include "CanvasSnapshot.h"
+#include "FrameRecorder.h"
+#include "ImageWriter.h"
+#include "LatencyRecorder.h"
+#include "LineDocument.h"
+#include "LineImporter.h"
+#include "LineJournal.h"
+#include "LineStore.h"
+#include "SpatialIndex.h"
+#include "UndoHistory.h"
+
 #include <GL/glew.h>
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Upper bound for the frames in flight knob
+static const int kMaxFramesInFlight = 3;
+
+// How finished lines combine with what is already in the canvas
+enum class BlendMode
+{
+	Over,	// Premultiplied over, the image depends on the order lines were committed in
+	Max		// Per channel maximum, commutative so any commit order gives the same image
+};
+
+// Chosen once at startup
+struct RendererSettings
+{
+	CanvasFormat format = CanvasFormat::RGBA8;
+	BlendMode blend = BlendMode::Over;
+	bool compress_snapshots = true;	// Raw snapshot tiles are bigger but upload straight from the mapping
+	bool raw_capture = false;		// Recorded frames are written unencoded
+	bool compact_lines = false;		// Lines drawn and imported are kept as CompactLine
+};
+
 class Renderer
 {
 public:
+	// Ways of getting the cached lines onto the back buffer
+	enum class CompositeMode
+	{
+		Draw,	// Textured full screen quad through mProgramToDisplay
+		Blit	// glBlitFramebuffer straight from each tile framebuffer
+	};
 
-	void initialize(int width, int height);
+	void initialize(int width, int height, const RendererSettings& settings = RendererSettings());
+	// Window client size changed, cheap since tiles don't depend on it
+	void resize(int width, int height);
+	void begin_frame();
 	void render();
+	void end_frame();
 	void shutdown();
 
+	// Input positions are window pixels relative to the window center with y up
 	void start_line(int x, int y)
 	{
-		mStartX = mEndX = x;
-		mStartY = mEndY = y;
+		mStartX = mEndX = canvas_x(x);
+		mStartY = mEndY = canvas_y(y);
 		mIsDrawingLine = true;
 	}
-	void line_endpoint(int x, int y)
+	// Time is when the platform layer received the input that moved the endpoint
+	void line_endpoint(int x, int y, std::chrono::steady_clock::time_point time)
 	{
-		mEndX = mVertical ? mStartX : x;
-		mEndY = mHorizontal ? mStartY : y;
+		mEndX = mVertical ? mStartX : canvas_x(x);
+		mEndY = mHorizontal ? mStartY : canvas_y(y);
+
+		// Keep the oldest input not yet drawn, coalesced moves count from the first one
+		if (!mHasPendingInput)
+			mPendingInputTime = time;
+		mHasPendingInput = true;
 	}
 	void end_line(int x, int y);
 	bool is_drawing_line() const { return mIsDrawingLine; }
-	void update_radius(float delta) { mRadius += delta * 0.00001f; }
+	void update_radius(float delta)
+	{
+		mRadius += delta * 0.00512f;
+		mRadius = mRadius < 0.5f ? 0.5f : mRadius;
+	}
 	void toggle_horizontal() { mHorizontal = !mHorizontal; }
 	void toggle_vertical() { mVertical = !mVertical; }
 	void toggle_mode() { mLineSimple = !mLineSimple; }
 
+	// Removing lines re-rasterizes only the area they covered, from the lines left there
+	// in their original order. Picking and erasing take window positions like start_line
+	bool pick_line(int x, int y, size_t& id);
+	bool delete_line(size_t id);
+	void erase(int x, int y);	// Brush is a circle of the current line radius
+
+	// Commits, deletions and erases can be undone. Snapshots of the tiles each one changed
+	// are kept up to the budget in bytes, older actions are re-rasterized from the lines
+	bool undo();
+	bool redo();
+	void set_undo_budget(size_t bytes);
+
+	// Opening maps the document and replaces the drawing with it, the canvas fills in over
+	// the following frames starting around the camera. Saving writes the lines left, and
+	// a snapshot of the canvas next to them in the background, only the tiles changed
+	// since the last one when it can. Opening restores the snapshot instead of
+	// rasterizing when it was taken for the same save
+	bool open_document(const char* path);
+	bool save_document(const char* path);
+	// Edits are journaled next to the document as they are committed, and replayed over
+	// it when it is opened again. At startup the document comes back only when its
+	// journal holds edits, otherwise the drawing starts empty journaling to the same path
+	bool start_session(const char* path);
+	// Something was drawn or removed since the last save
+	bool has_unsaved_changes() const { return !mSnapshotDirty.empty(); }
+
+	// Adds the lines of a CSV/TSV file to the drawing. Parsing runs on worker threads and
+	// lines show up as they are committed, a time slice per frame
+	bool import_lines(const char* path);
+
+	// Camera, pan is in window pixels and zoom keeps the given window position in place
+	void pan(int dx, int dy);
+	void zoom(int x, int y, float factor);
+
+	// Copies pixels to the CPU without stalling the frame, the callback runs on a worker
+	// thread a few frames later. Canvas rectangles are in pixels of the pyramid level,
+	// each covering 2^level canvas pixels. The window is read as the next frame shows it
+	void read_canvas(int x, int y, int width, int height, int level, ReadbackCallback callback);
+	void read_window(ReadbackCallback callback);
+	// Everything drawn at full resolution, PNG or QOI by extension
+	bool export_canvas(const char* path);
+	// Renders every line again with long_edge pixels on the longer side of the image,
+	// strip by strip over the next frames and streamed to the encoder, so memory use
+	// stays at a few strips whatever the size. PNG or QOI by extension
+	bool export_poster(const char* path, int long_edge);
+	// Starts or stops writing every drawn frame to a capture directory, frames are
+	// dropped rather than slowing drawing down when readback or the disk fall behind
+	void toggle_recording();
+
+	// Work spread over several frames is still going on, keep rendering
+	bool has_pending_work() const { return mPendingWork || mReadback.is_busy() || mWindowReadback; }
+
+	// Set when the pixel format keeps back buffer contents across swaps, so
+	// frames without a preview line can skip compositing altogether
+	void set_back_buffer_preserved(bool preserved) { mBackBufferPreserved = preserved; }
+	CompositeMode composite_mode() const { return mCompositeMode; }
+
+	// Frames the driver may queue ahead of the GPU, from 1 to kMaxFramesInFlight.
+	// 1 keeps the preview line closest to the cursor at the cost of CPU/GPU overlap,
+	// higher values trade that latency for throughput when the GPU is the bottleneck
+	void set_max_frames_in_flight(int frames);
+	void print_frame_stats();
+
+	// Measures input to GPU completion of the frame showing it, reported when turned off
+	void toggle_latency_measurement();
+
+	// Committed lines go through a multisampled scratch tile and get resolved into the
+	// canvas, anti-aliasing simple lines at rasterization cost. 0 samples disables it
+	void set_msaa_samples(int samples);
+	void cycle_msaa_samples();
+	void run_line_benchmark();
+
 private:
-	void create_framebuffer(int width, int height);
+	// Tile picked for compositing this frame
+	struct VisibleTile
+	{
+		Tile* tile;
+		int x, y;
+	};
+
+	// Canvas rectangle to re-rasterize
+	struct Region
+	{
+		float min_x, min_y, max_x, max_y;
+	};
+
+	// Snapshot being written, shared with the readback callbacks that fill it in. Those
+	// run one at a time on the readback worker
+	struct SnapshotJob
+	{
+		SnapshotWriter writer;
+		std::string path;
+		size_t batches_left = 0u;
+		bool delta = false;
+		std::atomic<bool> aborted{ false };
+		std::atomic<bool> failed{ false };
+		std::atomic<bool> done{ false };
+		std::chrono::high_resolution_clock::time_point start;
+	};
+
+	// Poster strip put together from its chunks on the readback worker
+	struct PosterStrip
+	{
+		std::vector<unsigned char> pixels;	// RGBA8 rows top down
+		int chunks_left = 0;
+	};
+
+	// Poster being exported. Chunks of a strip are rendered a time slice per frame and
+	// read back like window captures, their callbacks assemble the strips and write them
+	// in order as they complete
+	struct PosterJob
+	{
+		// Render thread
+		float left = 0.0f;	// Canvas position of the image's top left corner
+		float top = 0.0f;
+		float pixel = 1.0f;	// Canvas pixels per image pixel
+		int strip_count = 0;
+		int chunk_width = 0;
+		int chunk_count = 0;	// Per strip
+		int next_strip = 0;
+		int next_chunk = 0;
+		int samples = 0;
+		GLuint framebuffer = 0u;
+		GLuint texture = 0u;
+		GLuint msaa_framebuffer = 0u;
+		GLuint msaa_storage = 0u;
+
+		// Readback worker
+		ImageWriter writer;
+		std::string path;
+		int width = 0;
+		int height = 0;
+		int strip_rows = 0;
+		std::unordered_map<int, PosterStrip> strips;
+		int next_write = 0;
+		size_t peak_strips = 0u;
+		std::chrono::high_resolution_clock::time_point start;
+
+		// Chunks read back but not assembled yet, the last one out cleans up an aborted job
+		std::mutex mutex;
+		int in_flight = 0;
+		bool aborted = false;
+		std::atomic<bool> done{ false };
+	};
+
+	// Detail tile kept around while zoomed in, evicted least recently used first
+	struct DetailTile
+	{
+		int level, x, y;
+		unsigned long long last_used;
+	};
+
 	void create_buffers();
 	void create_shaders();
 	void check_shader_compiled(int shader, const char* shader_name);
 	void check_program_linked(int program, const char* program_name);
 	void assign_random_color();
-	void render_line();
+	void set_target(GLuint framebuffer, float origin_x, float origin_y, float scale, int width, int height);
+	void set_window_target();
+	Line current_line() const;
+	void render_line(const Line& line);
+	// Instanced draws reading the lines from mLineBuffer, skipping removed ones
+	void render_lines(const size_t* ids, size_t count);
+	bool sync_line_buffer(size_t count);
+	void commit_line(const Line& line);
+	void commit_lines(size_t first, size_t count);
+	void seed_scratch_tile(const Tile& tile, float origin_x, float origin_y);
 	void bind_plane();
 	void bind_line();
+	void composite(CompositeMode mode);
+	void draw_tiles(CompositeMode mode, int level, const std::vector<VisibleTile>& tiles);
+	void update_detail_tiles();
+	Tile& acquire_detail_tile(int level, int x, int y);
+	void apply_history(HistoryEntry& entry, bool restore_lines);
+	// Re-rasterizes where the lines were, canvas tiles too unless they were already restored
+	void redraw_lines(const std::vector<size_t>& lines, bool canvas_tiles);
+	void redraw_tile_region(Tile& tile, int level, int x, int y, const Region& region, bool multisampled);
+	void update_import();
+	bool readback_source(const ReadbackPiece& piece, GLuint& framebuffer);
+	void write_snapshot(const char* path, unsigned long long document_id);
+	static void finish_snapshot_batch(SnapshotJob& job);
+	void update_poster();
+	static void add_poster_chunk(PosterJob& job, int strip, int x, const ReadbackImage& image);
+	static void discard_poster(PosterJob& job);
+	void abort_poster();
+	// Level 0 tile about to be modified. Remembered for the next snapshot delta, and copied
+	// first when the snapshot in progress has yet to capture it
+	void before_tile_change(int x, int y);
+	void free_snapshot_tiles();
+	bool restore_snapshot(const char* path);
+	void reset_drawing();
+	void update_document_load();
+	void index_document_lines(size_t end);
+	void finish_document_index();
+	void rasterize_document_tile(int x, int y);
+	void collect_line_tiles(const Line& line, std::unordered_set<long long>& tiles) const;
+	// Applies the journal on top of mLines, returning the bytes to keep of it
+	size_t replay_journal(const char* path, unsigned long long save_id);
+	void journal_add(size_t id);
+	void journal_remove(size_t id);
+	void journal_restore(size_t id);
+	void select_composite_mode();
+	void retire_frames(bool wait);
+	void calibrate_gpu_clock();
+	void resolve_line(const Line& line, GLuint source, GLuint destination);
+	Tile* update_pyramid_tile(int level, int x, int y);
+	void visible_tiles(int level, int& min_x, int& min_y, int& max_x, int& max_y) const;
+	int canvas_x(int x) const { return static_cast<int>(floorf(mCameraX + x / mZoom + 0.5f)); }
+	int canvas_y(int y) const { return static_cast<int>(floorf(mCameraY + y / mZoom + 0.5f)); }
+	static float line_padding(const Line& line);
+
+	Canvas mCanvas;
+	BlendMode mBlendMode = BlendMode::Over;
+	LineStore mLines;
+	SpatialIndex mIndex;
+	UndoHistory mHistory;
+	HistoryEntry* mRecording = nullptr;	// Action whose tile changes are being snapshotted
+
+	// Opened document, indexed then rasterized a time slice per frame
+	LineDocument mDocument;
+	std::unordered_set<long long> mLoadTileSet;
+	std::vector<long long> mLoadTiles;
+	std::chrono::high_resolution_clock::time_point mLoadStart;
+	size_t mLoadLineCount = 0u;
+	size_t mLoadNextLine = 0u;
+	size_t mLoadNextTile = 0u;
+	bool mLoading = false;
+	bool mLoadRasterize = false;	// Tiles come from the lines, not a snapshot
+
+	// Journal of edits since the last save. Its ids number the saved lines and then the
+	// ones added since, mJournalIds maps line ids to them once a save dropped removed
+	// lines, empty while the two agree
+	LineJournal mJournal;
+	std::vector<size_t> mJournalIds;
+	size_t mJournalLines = 0u;
 
-	GLuint mFramebuffer = 0u;
-	GLuint mFramebufferTexture = 0u;
+	// Import in progress, batches of parsed lines are committed a time slice per frame
+	LineImporter mImporter;
+	std::vector<Line> mImportBatch;
+	std::chrono::high_resolution_clock::time_point mImportStart;
+	size_t mImportedLines = 0u;
+
+	AsyncReadback mReadback;
+	ReadbackCallback mWindowReadback;	// Capture waiting for the next frame
+	FrameRecorder mRecorder;
+	std::shared_ptr<PosterJob> mPoster;
+	FrameFormat mCaptureFormat = FrameFormat::QOI;
+
+	// Level 0 as it was when the last snapshot started. Tiles whose copy hasn't started
+	// are pending, and preserved on the GPU before anything changes them
+	std::shared_ptr<SnapshotJob> mSnapshot;
+	std::unordered_set<long long> mSnapshotPending;
+	std::unordered_map<long long, Tile> mSnapshotPreserved;
+	bool mCompressSnapshots = true;
+
+	// Snapshot chain deltas are appended to, a full snapshot followed by the deltas in its
+	// .delta file. Empty path when the next snapshot has to be a full one
+	std::unordered_set<long long> mSnapshotDirty;	// Level 0 tiles changed since the last snapshot
+	std::string mSnapshotPath;
+	unsigned long long mSnapshotId = 0u;	// Save id of the newest record
+	unsigned long long mSnapshotBaseBytes = 0u;
+	unsigned long long mSnapshotDeltaBytes = 0u;
+	int mSnapshotDeltas = 0;
+
+	// Detail tiles and the one being rasterized from the line model over several frames
+	std::vector<DetailTile> mDetailTiles;
+	std::vector<VisibleTile> mReadyDetailTiles;
+	int mDetailLevel = 0;
+	int mJobLevel = 0;
+	int mJobX = 0;
+	int mJobY = 0;
+	std::vector<size_t> mJobLines;
+	std::vector<size_t> mRedrawLines;
+	size_t mJobNextLine = 0u;
+	bool mJobActive = false;
+	unsigned long long mFrameIndex = 0u;
+
+	GLuint mMsaaFramebuffer = 0u;
+	GLuint mMsaaRenderbuffer = 0u;
 	GLuint mPlane = 0u;
 	GLuint mLine = 0u;
 	GLuint mProgramToDisplay = 0u;
 	GLuint mProgramSDF = 0u;
 	GLuint mProgramSimple = 0u;
+	GLuint mProgramBatchSDF = 0u;
+	GLuint mProgramBatchSimple = 0u;
+
+	// Copy of the line model on the GPU for the batched programs, filled in id order
+	GLuint mLineBuffer = 0u;
+	GLuint mLineTexture = 0u;
+	GLuint mIdBuffer = 0u;
+	size_t mLineBufferCapacity = 0u;
+	size_t mUploadedLines = 0u;
+	std::vector<Line> mUploadScratch;	// Compact lines decoded for the upload
+	size_t mMaxBatchLines = 0u;
+	std::vector<unsigned int> mBatchIds;
+
+	CompositeMode mCompositeMode = CompositeMode::Draw;
 
+	// Ring of fences, one per frame still queued on the GPU
+	GLsync mFrameFences[kMaxFramesInFlight] = {};
+	int mOldestFrame = 0;
+	int mFramesInFlight = 0;
+	int mMaxFramesInFlight = 2;
+
+	// Latency measurement, GPU timestamps are mapped to the CPU clock with mGpuClockOffset
+	GLuint mFrameQueries[kMaxFramesInFlight] = {};
+	std::chrono::steady_clock::time_point mFrameInputTimes[kMaxFramesInFlight];
+	bool mFrameHasInput[kMaxFramesInFlight] = {};
+	std::chrono::steady_clock::time_point mPendingInputTime;
+	std::chrono::steady_clock::time_point mRenderedInputTime;
+	long long mGpuClockOffset = 0;
+	LatencyRecorder mLatency;
+	bool mHasPendingInput = false;
+	bool mHasRenderedInput = false;
+	bool mMeasureLatency = false;
+
+	// Queue depth stats since the knob was last changed
+	long long mStatsFrames = 0;
+	long long mStatsQueueDepth = 0;
+	int mStatsMaxQueueDepth = 0;
+	double mStatsWaitTime = 0.0;
+
+	int mWidth = 0;
+	int mHeight = 0;
+	int mMsaaSamples = 0;
+	int mMaxMsaaSamples = 0;
 	float mHalfWidth = 0.0f;
 	float mHalfHeight = 0.0f;
-	float mR = 0.0f;
-	float mG = 0.0f;
-	float mB = 0.0f;
-	float mRadius = 0.01f;
+
+	// Canvas position at the window center and window pixels per canvas pixel
+	float mCameraX = 0.0f;
+	float mCameraY = 0.0f;
+	float mZoom = 1.0f;
+
+	// Framebuffer lines are rendered to, origin is the canvas position of its pixel (0, 0)
+	// and scale the canvas pixels per target pixel
+	float mTargetOriginX = 0.0f;
+	float mTargetOriginY = 0.0f;
+	float mTargetScale = 1.0f;
+	int mTargetWidth = 0;
+	int mTargetHeight = 0;
+
+	unsigned int mColor = 0u;
+	float mRadius = 5.12f;	// In pixels
 	int mStartX = 0;
 	int mEndX = 0;
 	int mStartY = 0;
@@ -61,4 +444,8 @@ private:
 	bool mHorizontal = false;
 	bool mVertical = false;
 	bool mLineSimple = false;
+	bool mBackBufferPreserved = false;
+	bool mBackBufferValid = false;
+	bool mPendingWork = false;
+	int mDownsampleBudget = 0;
 };
@@ -0,0 +1,163 @@
+#include "SpatialIndex.h"
+
+#include "Geometry.h"
+
+#include <algorithm>
+#include <math.h>
+
+void SpatialIndex::insert(size_t id, const Line& line)
+{
+	int level;
+	long long key;
+	locate(line, level, key);
+	mLevels[level][key].push_back(static_cast<unsigned int>(id));
+	++mLineCount;
+}
+
+void SpatialIndex::remove(size_t id, const Line& line)
+{
+	int level;
+	long long key;
+	locate(line, level, key);
+	auto cell = mLevels[level].find(key);
+	if (cell == mLevels[level].end())
+		return;
+
+	// Order within a cell doesn't matter, queries sort their results
+	std::vector<unsigned int>& ids = cell->second;
+	auto it = std::find(ids.begin(), ids.end(), static_cast<unsigned int>(id));
+	if (it == ids.end())
+		return;
+	*it = ids.back();
+	ids.pop_back();
+	if (ids.empty())
+		mLevels[level].erase(cell);
+	--mLineCount;
+}
+
+void SpatialIndex::clear()
+{
+	for (int level = 0; level < kLevelCount; ++level)
+		Cells().swap(mLevels[level]);
+	mLineCount = 0u;
+}
+
+void SpatialIndex::query_region(const LineStore& lines, float min_x, float min_y, float max_x, float max_y, std::vector<size_t>& ids) const
+{
+	ids.clear();
+	for (int level = 0; level < kLevelCount; ++level)
+	{
+		const Cells& cells = mLevels[level];
+		if (cells.empty())
+			continue;
+
+		// Cells whose loose bounds, half a cell bigger on each side, overlap the rectangle
+		float size = cell_size(level);
+		float half = size * 0.5f;
+		long long x0 = static_cast<long long>(ceilf((min_x - half) / size)) - 1;
+		long long y0 = static_cast<long long>(ceilf((min_y - half) / size)) - 1;
+		long long x1 = static_cast<long long>(floorf((max_x + half) / size));
+		long long y1 = static_cast<long long>(floorf((max_y + half) / size));
+		auto test_cell = [&](const std::vector<unsigned int>& cell)
+		{
+			for (unsigned int id : cell)
+			{
+				const Line& line = lines.get(id);
+				if (segment_near_rect(line.start_x, line.start_y, line.end_x, line.end_y, reach(line), min_x, min_y, max_x, max_y))
+					ids.push_back(id);
+			}
+		};
+
+		// Large regions on fine levels have more cells in range than occupied ones
+		if (static_cast<double>(x1 - x0 + 1) * static_cast<double>(y1 - y0 + 1) > static_cast<double>(cells.size()))
+		{
+			for (const auto& cell : cells)
+			{
+				long long x = cell.first >> 32;
+				long long y = static_cast<int>(cell.first & 0xffffffff);
+				if (x >= x0 && x <= x1 && y >= y0 && y <= y1)
+					test_cell(cell.second);
+			}
+		}
+		else
+		{
+			for (long long y = y0; y <= y1; ++y)
+			{
+				for (long long x = x0; x <= x1; ++x)
+				{
+					auto cell = cells.find(cell_key(static_cast<int>(x), static_cast<int>(y)));
+					if (cell != cells.end())
+						test_cell(cell->second);
+				}
+			}
+		}
+	}
+	std::sort(ids.begin(), ids.end());
+}
+
+bool SpatialIndex::query_nearest(const LineStore& lines, float x, float y, float max_distance, size_t& id) const
+{
+	// Grow the search square until it holds a line closer than its half size
+	std::vector<size_t> candidates;
+	float radius = static_cast<float>(kCellSize);
+	for (;;)
+	{
+		radius = radius < max_distance ? radius : max_distance;
+		query_region(lines, x - radius, y - radius, x + radius, y + radius, candidates);
+
+		// Ties go to the later line, it is drawn on top
+		float best = radius;
+		bool found = false;
+		for (size_t candidate : candidates)
+		{
+			const Line& line = lines.get(candidate);
+			float distance = point_segment_distance(x, y, line.start_x, line.start_y, line.end_x, line.end_y);
+			distance -= line.radius > 0.0f ? line.radius : 0.5f;
+			distance = distance > 0.0f ? distance : 0.0f;
+			if (distance <= best)
+			{
+				best = distance;
+				id = candidate;
+				found = true;
+			}
+		}
+		if (found || radius >= max_distance)
+			return found;
+		radius *= 2.0f;
+	}
+}
+
+size_t SpatialIndex::memory_usage() const
+{
+	// Rough hash map node cost on top of the id buckets
+	size_t bytes = 0u;
+	for (int level = 0; level < kLevelCount; ++level)
+	{
+		bytes += mLevels[level].bucket_count() * sizeof(void*);
+		for (const auto& cell : mLevels[level])
+			bytes += sizeof(cell) + 2u * sizeof(void*) + cell.second.capacity() * sizeof(unsigned int);
+	}
+	return bytes;
+}
+
+void SpatialIndex::locate(const Line& line, int& level, long long& key) const
+{
+	// Finest level whose cells are at least as big as the capsule bounds
+	float padding = reach(line);
+	float extent_x = fabsf(line.end_x - line.start_x) + 2.0f * padding;
+	float extent_y = fabsf(line.end_y - line.start_y) + 2.0f * padding;
+	float extent = extent_x > extent_y ? extent_x : extent_y;
+	level = 0;
+	while (level + 1 < kLevelCount && cell_size(level) < extent)
+		++level;
+
+	float size = cell_size(level);
+	float center_x = (line.start_x + line.end_x) * 0.5f;
+	float center_y = (line.start_y + line.end_y) * 0.5f;
+	key = cell_key(static_cast<int>(floorf(center_x / size)), static_cast<int>(floorf(center_y / size)));
+}
+
+float SpatialIndex::cell_size(int level)
+{
+	return ldexpf(static_cast<float>(kCellSize), level);
+}
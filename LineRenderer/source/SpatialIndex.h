@@ -0,0 +1,50 @@
+#pragma once
+
+#include "LineStore.h"
+
+#include <stddef.h>
+#include <unordered_map>
+#include <vector>
+
+// Hierarchical loose grid over line capsules. Every line lives in exactly one cell: the
+// one containing its center on the finest level whose cells are at least as large as
+// its bounds, so memory is one id per line plus one bucket per occupied cell. Queries
+// look one half cell further out on each level to catch lines sticking out of theirs
+class SpatialIndex
+{
+public:
+	static const int kLevelCount = 20;
+	static const int kCellSize = 64;	// Level 0 cell size in canvas pixels
+
+	// Extra distance every capsule reaches beyond its radius, e.g. anti-aliasing fade
+	void set_margin(float margin) { mMargin = margin; }
+
+	void insert(size_t id, const Line& line);
+	void remove(size_t id, const Line& line);
+	void clear();
+
+	// Ids of the lines whose capsule reaches the rectangle, in ascending (submission) order
+	void query_region(const LineStore& lines, float min_x, float min_y, float max_x, float max_y, std::vector<size_t>& ids) const;
+	// Line whose capsule is closest to the point, within max_distance of its edge
+	bool query_nearest(const LineStore& lines, float x, float y, float max_distance, size_t& id) const;
+
+	size_t line_count() const { return mLineCount; }
+	size_t memory_usage() const;
+
+	// Distance from the segment that still counts as part of the line
+	float reach(const Line& line) const { return (line.radius > 0.0f ? line.radius : 1.0f) + mMargin; }
+
+private:
+	typedef std::unordered_map<long long, std::vector<unsigned int>> Cells;
+
+	void locate(const Line& line, int& level, long long& key) const;
+	static float cell_size(int level);
+	static long long cell_key(int x, int y)
+	{
+		return (static_cast<long long>(x) << 32) | static_cast<unsigned int>(y);
+	}
+
+	Cells mLevels[kLevelCount];
+	size_t mLineCount = 0u;
+	float mMargin = 0.0f;
+};
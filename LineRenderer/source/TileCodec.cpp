@@ -0,0 +1,244 @@
+#include "TileCodec.h"
+
+#include <string.h>
+
+namespace
+{
+	enum Method : unsigned char
+	{
+		kSolid = 0,	// One word repeated
+		kRuns = 1,	// (count - 1 as varint, word) pairs
+		kLZ = 2,	// Literal runs and back references over the raw bytes
+		kRaw = 3	// Stored as is, for noise that doesn't compress
+	};
+
+	// Shortest back reference worth encoding and the window it can reach
+	const size_t kMinMatch = 4u;
+	const size_t kMaxOffset = 65535u;
+	const int kHashBits = 14;
+
+	void write_varint(std::vector<unsigned char>& out, size_t value)
+	{
+		while (value >= 0x80u)
+		{
+			out.push_back(static_cast<unsigned char>(value | 0x80u));
+			value >>= 7;
+		}
+		out.push_back(static_cast<unsigned char>(value));
+	}
+
+	bool read_varint(const unsigned char*& data, const unsigned char* end, size_t& value)
+	{
+		value = 0u;
+		for (int shift = 0; data < end && shift < 64; shift += 7)
+		{
+			unsigned char byte = *data++;
+			value |= static_cast<size_t>(byte & 0x7fu) << shift;
+			if (!(byte & 0x80u))
+				return true;
+		}
+		return false;
+	}
+
+	// Token lengths use a nibble each, 15 means the rest follows as a varint
+	void write_length(std::vector<unsigned char>& out, size_t length)
+	{
+		if (length >= 15u)
+			write_varint(out, length - 15u);
+	}
+
+	bool read_length(const unsigned char*& data, const unsigned char* end, size_t& length)
+	{
+		if (length < 15u)
+			return true;
+		size_t extra;
+		if (!read_varint(data, end, extra))
+			return false;
+		length += extra;
+		return true;
+	}
+
+	unsigned int read32(const unsigned char* p)
+	{
+		unsigned int value;
+		memcpy(&value, p, 4u);
+		return value;
+	}
+
+	void compress_runs(const unsigned int* words, size_t word_count, std::vector<unsigned char>& out, size_t limit)
+	{
+		out.push_back(kRuns);
+		for (size_t i = 0u; i < word_count && out.size() < limit;)
+		{
+			size_t run = 1u;
+			while (i + run < word_count && words[i + run] == words[i])
+				++run;
+			write_varint(out, run - 1u);
+			const unsigned char* bytes = reinterpret_cast<const unsigned char*>(words + i);
+			out.insert(out.end(), bytes, bytes + 4);
+			i += run;
+		}
+	}
+
+	void compress_lz(const unsigned char* bytes, size_t size, std::vector<unsigned char>& out)
+	{
+		out.push_back(kLZ);
+		std::vector<unsigned int> table(1u << kHashBits, 0xffffffffu);
+		size_t literal_start = 0u;
+		size_t i = 0u;
+		auto emit = [&](size_t match_length, size_t offset)
+		{
+			size_t literals = i - literal_start;
+			size_t match_code = match_length ? match_length - kMinMatch : 0u;
+			unsigned char token = static_cast<unsigned char>(((literals < 15u ? literals : 15u) << 4) | (match_code < 15u ? match_code : 15u));
+			out.push_back(token);
+			write_length(out, literals);
+			out.insert(out.end(), bytes + literal_start, bytes + i);
+			if (match_length)
+			{
+				out.push_back(static_cast<unsigned char>(offset & 0xffu));
+				out.push_back(static_cast<unsigned char>(offset >> 8));
+				write_length(out, match_code);
+			}
+		};
+
+		while (i + kMinMatch <= size)
+		{
+			unsigned int sequence = read32(bytes + i);
+			unsigned int hash = (sequence * 2654435761u) >> (32 - kHashBits);
+			size_t candidate = table[hash];
+			table[hash] = static_cast<unsigned int>(i);
+			if (candidate == 0xffffffffu || i - candidate > kMaxOffset || read32(bytes + candidate) != sequence)
+			{
+				++i;
+				continue;
+			}
+
+			size_t length = kMinMatch;
+			while (i + length < size && bytes[candidate + length] == bytes[i + length])
+				++length;
+			emit(length, i - candidate);
+			i += length;
+			literal_start = i;
+		}
+
+		// Trailing literals close the stream with an empty match
+		i = size;
+		emit(0u, 0u);
+	}
+}
+
+void TileCodec::compress(const unsigned char* pixels, size_t size, std::vector<unsigned char>& out)
+{
+	out.clear();
+	size_t word_count = size / 4u;
+	const unsigned int* words = reinterpret_cast<const unsigned int*>(pixels);
+	size_t first_other = 1u;
+	while (first_other < word_count && words[first_other] == words[0])
+		++first_other;
+	if (first_other >= word_count)
+	{
+		out.push_back(kSolid);
+		out.insert(out.end(), pixels, pixels + 4);
+		return;
+	}
+
+	// Runs are cheap to try and win on mostly flat tiles, give up on them once they
+	// stop paying off
+	size_t raw_size = size;
+	compress_runs(words, word_count, out, raw_size / 8u);
+	if (out.size() < raw_size / 8u)
+		return;
+
+	std::vector<unsigned char> lz;
+	lz.reserve(raw_size / 4u);
+	compress_lz(pixels, raw_size, lz);
+	if (lz.size() < raw_size)
+	{
+		out.swap(lz);
+		return;
+	}
+	out.clear();
+	out.push_back(kRaw);
+	out.insert(out.end(), pixels, pixels + raw_size);
+}
+
+bool TileCodec::decompress(const unsigned char* data, size_t size, unsigned char* pixels, size_t pixels_size)
+{
+	if (size < 1u)
+		return false;
+
+	const unsigned char* end = data + size;
+	unsigned char method = *data++;
+	size_t raw_size = pixels_size;
+	size_t word_count = pixels_size / 4u;
+	if (method == kSolid)
+	{
+		if (end - data != 4)
+			return false;
+		for (size_t i = 0u; i < word_count; ++i)
+			memcpy(pixels + i * 4u, data, 4u);
+		return true;
+	}
+
+	if (method == kRaw)
+	{
+		if (static_cast<size_t>(end - data) != raw_size)
+			return false;
+		memcpy(pixels, data, raw_size);
+		return true;
+	}
+
+	if (method == kRuns)
+	{
+		size_t written = 0u;
+		while (data < end)
+		{
+			size_t run;
+			if (!read_varint(data, end, run) || end - data < 4 || run + 1u > word_count - written)
+				return false;
+			for (size_t i = 0u; i <= run; ++i)
+				memcpy(pixels + (written + i) * 4u, data, 4u);
+			written += run + 1u;
+			data += 4;
+		}
+		return written == word_count;
+	}
+
+	if (method == kLZ)
+	{
+		size_t written = 0u;
+		while (data < end)
+		{
+			unsigned char token = *data++;
+			size_t literals = token >> 4;
+			if (!read_length(data, end, literals) || static_cast<size_t>(end - data) < literals || literals > raw_size - written)
+				return false;
+			memcpy(pixels + written, data, literals);
+			written += literals;
+			data += literals;
+			if (data == end)
+				break;
+
+			if (end - data < 2)
+				return false;
+			size_t offset = data[0] | (static_cast<size_t>(data[1]) << 8);
+			data += 2;
+			size_t length = token & 0x0fu;
+			if (!read_length(data, end, length))
+				return false;
+			length += kMinMatch;
+			if (offset == 0u || offset > written || length > raw_size - written)
+				return false;
+
+			// Overlapping copies repeat the last offset bytes, so go byte by byte
+			unsigned char* out = pixels + written;
+			const unsigned char* match = out - offset;
+			for (size_t i = 0u; i < length; ++i)
+				out[i] = match[i];
+			written += length;
+		}
+		return written == raw_size;
+	}
+	return false;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Lossless CPU codec for tile contents, seen as 32-bit words whatever the canvas format
+// (an RGBA8 or RGB10A2 pixel, half an RGBA16F one or four R8 ones). Flat tiles become a
+// single word, tiles made of long runs are run length encoded and anything else goes
+// through a byte oriented LZ77 in the spirit of LZ4: greedy hash matching, no entropy
+// coding, so both directions run at memory speed. Noise that doesn't compress is stored
+// as is
+namespace TileCodec
+{
+	// Size in bytes, a multiple of 4
+	void compress(const unsigned char* pixels, size_t size, std::vector<unsigned char>& out);
+	// False when the data is corrupt or doesn't decode to exactly pixels_size bytes
+	bool decompress(const unsigned char* data, size_t size, unsigned char* pixels, size_t pixels_size);
+}
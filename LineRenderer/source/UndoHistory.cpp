@@ -0,0 +1,141 @@
+#include "UndoHistory.h"
+
+#include <stdio.h>
+#include <utility>
+
+void UndoHistory::set_budget(size_t bytes)
+{
+	mBudget = bytes;
+	enforce_budget();
+}
+
+HistoryEntry& UndoHistory::begin(HistoryEntry::Type type)
+{
+	for (HistoryEntry& entry : mRedo)
+		drop_snapshots(entry);
+	mRedo.clear();
+
+	mUndo.push_back(HistoryEntry());
+	mUndo.back().type = type;
+	return mUndo.back();
+}
+
+void UndoHistory::snapshot(HistoryEntry& entry, Canvas& canvas, int x, int y)
+{
+	for (const TileSnapshot& snapshot : entry.tiles)
+		if (snapshot.x == x && snapshot.y == y)
+			return;
+
+	// A tile the action allocates is recorded as missing
+	TileSnapshot snapshot = { x, y, Tile() };
+	Tile* tile = canvas.find_tile(0, x, y);
+	if (tile && tile->framebuffer)
+	{
+		mTileBytes = canvas.tile_bytes();
+		if (!canvas.allocate_tile(snapshot.tile))
+			fprintf(stdout, "Snapshot of tile (%d, %d) failed to complete.\n", x, y);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, tile->framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, snapshot.tile.framebuffer);
+		glBlitFramebuffer(0, 0, Canvas::kTileSize, Canvas::kTileSize, 0, 0, Canvas::kTileSize, Canvas::kTileSize, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		++mSnapshotTiles;
+	}
+	entry.tiles.push_back(snapshot);
+}
+
+void UndoHistory::end()
+{
+	enforce_budget();
+}
+
+HistoryEntry* UndoHistory::undo()
+{
+	if (mUndo.empty())
+		return nullptr;
+	mRedo.push_back(std::move(mUndo.back()));
+	mUndo.pop_back();
+	return &mRedo.back();
+}
+
+HistoryEntry* UndoHistory::redo()
+{
+	if (mRedo.empty())
+		return nullptr;
+	mUndo.push_back(std::move(mRedo.back()));
+	mRedo.pop_back();
+	return &mUndo.back();
+}
+
+void UndoHistory::exchange(HistoryEntry& entry, Canvas& canvas)
+{
+	for (TileSnapshot& snapshot : entry.tiles)
+	{
+		if (snapshot.tile.framebuffer)
+			--mSnapshotTiles;
+		canvas.exchange_tile(0, snapshot.x, snapshot.y, snapshot.tile);
+		canvas.mark_ancestors_dirty(snapshot.x, snapshot.y);
+		if (snapshot.tile.framebuffer)
+			++mSnapshotTiles;
+	}
+	enforce_budget();
+}
+
+void UndoHistory::invalidate_tile(int x, int y)
+{
+	auto invalidate = [x, y, this](HistoryEntry& entry)
+	{
+		for (const TileSnapshot& snapshot : entry.tiles)
+		{
+			if (snapshot.x == x && snapshot.y == y)
+			{
+				drop_snapshots(entry);
+				return;
+			}
+		}
+	};
+	for (HistoryEntry& entry : mUndo)
+		invalidate(entry);
+	for (HistoryEntry& entry : mRedo)
+		invalidate(entry);
+}
+
+void UndoHistory::clear()
+{
+	for (HistoryEntry& entry : mUndo)
+		drop_snapshots(entry);
+	for (HistoryEntry& entry : mRedo)
+		drop_snapshots(entry);
+	mUndo.clear();
+	mRedo.clear();
+}
+
+void UndoHistory::drop_snapshots(HistoryEntry& entry)
+{
+	for (TileSnapshot& snapshot : entry.tiles)
+	{
+		if (snapshot.tile.framebuffer)
+			--mSnapshotTiles;
+		Canvas::free_tile(snapshot.tile);
+	}
+	entry.tiles.clear();
+	entry.tiles.shrink_to_fit();
+	entry.replay = true;
+}
+
+void UndoHistory::enforce_budget()
+{
+	// Furthest from the present first: bottom of the undo stack, then of the redo stack
+	for (HistoryEntry& entry : mUndo)
+	{
+		if (memory_usage() <= mBudget)
+			return;
+		if (!entry.replay)
+			drop_snapshots(entry);
+	}
+	for (HistoryEntry& entry : mRedo)
+	{
+		if (memory_usage() <= mBudget)
+			return;
+		if (!entry.replay)
+			drop_snapshots(entry);
+	}
+}
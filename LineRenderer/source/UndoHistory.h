@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Canvas.h"
+
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+// Level 0 tile as it was before an action, or after it once the action is undone
+struct TileSnapshot
+{
+	int x, y;
+	Tile tile;	// No storage when the tile did not exist
+};
+
+// One undoable edit and the canvas tiles it changed
+struct HistoryEntry
+{
+	enum class Type
+	{
+		Add,	// Lines were committed
+		Remove	// Lines were deleted or erased
+	};
+
+	Type type = Type::Add;
+	std::vector<size_t> lines;
+	std::vector<TileSnapshot> tiles;
+	bool replay = false;	// Snapshots were evicted, re-rasterize from the line model instead
+};
+
+// Undo and redo stacks. Every entry copies a tile the first time the action modifies it,
+// and undoing swaps the copy with the canvas tile so the same storage serves redo. When
+// the copies outgrow the budget the oldest entries drop theirs and fall back to replay
+class UndoHistory
+{
+public:
+	void set_budget(size_t bytes);
+
+	// Starts recording an action, which discards everything that could be redone
+	HistoryEntry& begin(HistoryEntry::Type type);
+	// Copies the tile before the recorded action first changes it
+	void snapshot(HistoryEntry& entry, Canvas& canvas, int x, int y);
+	void end();
+
+	// Entry to revert or apply again, moved to the other stack. Null when there is none
+	HistoryEntry* undo();
+	HistoryEntry* redo();
+	// Swaps the entry's snapshots with the canvas tiles, leaving the replaced contents in
+	// the entry for the opposite direction
+	void exchange(HistoryEntry& entry, Canvas& canvas);
+	// The tile was rewritten outside any recorded action, so snapshots of it no longer
+	// fit around it and the entries holding them fall back to replay
+	void invalidate_tile(int x, int y);
+
+	void clear();
+	size_t memory_usage() const { return mSnapshotTiles * mTileBytes; }
+
+private:
+	void drop_snapshots(HistoryEntry& entry);
+	void enforce_budget();
+
+	std::deque<HistoryEntry> mUndo;
+	std::deque<HistoryEntry> mRedo;
+	size_t mSnapshotTiles = 0u;
+	size_t mTileBytes = 0u;
+	size_t mBudget = 64u * 1024u * 1024u;
+};
@@ -2,54 +2,180 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <shellapi.h>
 
 #include <GL/glew.h>
 #include <GL/wglew.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <chrono>
 
 static bool windowAlive = true;
+static bool redraw = true;	// Set whenever input or a committed line changes what is on screen
+static bool sizing = false;	// Inside the modal resize loop, the main loop is not running
+static bool erasing = false;	// Left button erases lines instead of drawing them
+static POINT panAnchor;
 static int width = 1024;
 static int h_width = width / 2;
 static int height = 1024;
 static int h_height = height / 2;
 static Renderer renderer;
+static HDC renderDevice = NULL;
+static const char* documentPath = "drawing.lines";	// Saved with S, opened with O or from the command line
+static char droppedPath[MAX_PATH];
+static char documentBuffer[MAX_PATH];	// Dropped document, documentPath never points into droppedPath
+static const UINT_PTR autosaveTimer = 2;	// Timer 1 keeps frames going while sizing
+static const UINT autosaveInterval = 60000;	// Milliseconds
+static int posterEdge = 32768;	// Pixels on the longer side of posters exported with G, poster=N to change
+
+static bool hasExtension(const char* path, const char* extension)
+{
+	size_t length = strlen(path), extension_length = strlen(extension);
+	return length > extension_length && _stricmp(path + length - extension_length, extension) == 0;
+}
+
+static void drawFrame()
+{
+	renderer.begin_frame();
+	renderer.render();
+	SwapBuffers(renderDevice);
+	renderer.end_frame();
+}
 
 static LRESULT CALLBACK mainWindowCallback(HWND windowHandle, UINT messageID, WPARAM wParam, LPARAM lParam)
 {
+	// Timestamp on arrival for input latency measurement
+	std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+
 	if (messageID == WM_CLOSE)
 		windowAlive = false;
+	else if (messageID == WM_PAINT)
+		redraw = true;
+	else if (messageID == WM_SIZE && LOWORD(lParam) > 0 && HIWORD(lParam) > 0)
+	{
+		// Tiles don't depend on the window, only the visible area changes. Newly exposed
+		// detail tiles fill in over the next frames like after a pan
+		redraw = true;
+		width = LOWORD(lParam);
+		height = HIWORD(lParam);
+		h_width = width / 2;
+		h_height = height / 2;
+		renderer.resize(width, height);
+		if (sizing)
+			drawFrame();
+	}
+	else if (messageID == WM_DROPFILES)
+	{
+		// A dropped document replaces the drawing, any other file is imported as CSV/TSV
+		HDROP drop = reinterpret_cast<HDROP>(wParam);
+		if (DragQueryFileA(drop, 0, droppedPath, MAX_PATH) > 0)
+		{
+			redraw = true;
+			if (hasExtension(droppedPath, ".lines"))
+			{
+				strncpy(documentBuffer, droppedPath, MAX_PATH - 1);
+				documentPath = documentBuffer;
+				renderer.open_document(documentPath);
+			}
+			else
+				renderer.import_lines(droppedPath);
+		}
+		DragFinish(drop);
+	}
+	else if (messageID == WM_ENTERSIZEMOVE)
+	{
+		// Keep drawing while the system runs its own message loop for the drag
+		sizing = true;
+		SetTimer(windowHandle, 1, USER_TIMER_MINIMUM, NULL);
+	}
+	else if (messageID == WM_EXITSIZEMOVE)
+	{
+		sizing = false;
+		KillTimer(windowHandle, 1);
+	}
+	else if (messageID == WM_TIMER && wParam == autosaveTimer)
+	{
+		// Snapshots only write the tiles changed since the last save, so this stays cheap
+		if (renderer.has_unsaved_changes() && !renderer.is_drawing_line() && !renderer.has_pending_work())
+			renderer.save_document(documentPath);
+	}
+	else if (messageID == WM_TIMER && sizing && renderer.has_pending_work())
+		drawFrame();
 	else if (messageID == WM_LBUTTONDOWN)
 	{
+		redraw = true;
 		POINT pt;
 		GetCursorPos(&pt);
 		ScreenToClient(windowHandle, &pt);
 		pt.x -= h_width;
 		pt.y -= h_height;
 		pt.y = -pt.y;
-		if (renderer.is_drawing_line())
+		if (erasing)
+			renderer.erase(pt.x, pt.y);
+		else if (renderer.is_drawing_line())
 			renderer.end_line(pt.x, pt.y);
 		else
 			renderer.start_line(pt.x, pt.y);
 	}
+	else if (messageID == WM_RBUTTONDOWN)
+	{
+		panAnchor.x = static_cast<short>(LOWORD(lParam));
+		panAnchor.y = static_cast<short>(HIWORD(lParam));
+	}
+	else if (messageID == WM_MOUSEMOVE && (wParam & MK_RBUTTON))
+	{
+		// Drag the canvas along, window y goes down while canvas y goes up
+		redraw = true;
+		POINT pt;
+		pt.x = static_cast<short>(LOWORD(lParam));
+		pt.y = static_cast<short>(HIWORD(lParam));
+		renderer.pan(pt.x - panAnchor.x, panAnchor.y - pt.y);
+		panAnchor = pt;
+	}
+	else if (erasing && messageID == WM_MOUSEMOVE && (wParam & MK_LBUTTON))
+	{
+		redraw = true;
+		POINT pt;
+		pt.x = static_cast<short>(LOWORD(lParam)) - h_width;
+		pt.y = h_height - static_cast<short>(HIWORD(lParam));
+		renderer.erase(pt.x, pt.y);
+	}
 	else if (renderer.is_drawing_line() && messageID == WM_MOUSEMOVE)
 	{
+		redraw = true;
 		POINT pt;
 		GetCursorPos(&pt);
 		ScreenToClient(windowHandle, &pt);
 		pt.x -= h_width;
 		pt.y -= h_height;
 		pt.y = -pt.y;
-		renderer.line_endpoint(pt.x, pt.y);
+		renderer.line_endpoint(pt.x, pt.y, arrival);
 	}
 	else if (renderer.is_drawing_line() && messageID == WM_MOUSEWHEEL)
 	{
+		redraw = true;
 		float delta = static_cast<float>(GET_WHEEL_DELTA_WPARAM(wParam));
 		renderer.update_radius(delta);
 	}
+	else if (messageID == WM_MOUSEWHEEL)
+	{
+		redraw = true;
+		POINT pt;
+		GetCursorPos(&pt);
+		ScreenToClient(windowHandle, &pt);
+		pt.x -= h_width;
+		pt.y -= h_height;
+		pt.y = -pt.y;
+		float notches = static_cast<float>(GET_WHEEL_DELTA_WPARAM(wParam)) / WHEEL_DELTA;
+		renderer.zoom(pt.x, pt.y, powf(1.25f, notches));
+	}
 	else if (messageID == WM_KEYDOWN)
 	{
+		redraw = true;
 		if (wParam == VK_CONTROL)
 		{
 			renderer.toggle_horizontal();
@@ -59,7 +185,7 @@ static LRESULT CALLBACK mainWindowCallback(HWND windowHandle, UINT messageID, WP
 			pt.x -= h_width;
 			pt.y -= h_height;
 			pt.y = -pt.y;
-			renderer.line_endpoint(pt.x, pt.y);
+			renderer.line_endpoint(pt.x, pt.y, arrival);
 		}
 		else if (wParam == VK_SHIFT)
 		{
@@ -70,19 +196,120 @@ static LRESULT CALLBACK mainWindowCallback(HWND windowHandle, UINT messageID, WP
 			pt.x -= h_width;
 			pt.y -= h_height;
 			pt.y = -pt.y;
-			renderer.line_endpoint(pt.x, pt.y);
+			renderer.line_endpoint(pt.x, pt.y, arrival);
 		}
 		else if (wParam == VK_SPACE)
 		{
 			renderer.toggle_mode();
 		}
+		else if (wParam >= '1' && wParam <= '3')
+		{
+			renderer.set_max_frames_in_flight(static_cast<int>(wParam - '0'));
+		}
+		else if (wParam == 'L')
+		{
+			renderer.toggle_latency_measurement();
+		}
+		else if (wParam == 'M')
+		{
+			renderer.cycle_msaa_samples();
+		}
+		else if (wParam == 'B')
+		{
+			renderer.run_line_benchmark();
+		}
+		else if (wParam == 'E' && !renderer.is_drawing_line())
+		{
+			erasing = !erasing;
+		}
+		else if (wParam == 'Z' && !renderer.is_drawing_line())
+		{
+			renderer.undo();
+		}
+		else if (wParam == 'Y' && !renderer.is_drawing_line())
+		{
+			renderer.redo();
+		}
+		else if (wParam == 'S' && !renderer.is_drawing_line())
+		{
+			renderer.save_document(documentPath);
+		}
+		else if (wParam == 'O' && !renderer.is_drawing_line())
+		{
+			renderer.open_document(documentPath);
+		}
+		else if (wParam == 'P')
+		{
+			// Screenshot readback, the callback runs on the readback worker thread
+			std::chrono::steady_clock::time_point requested = arrival;
+			renderer.read_window([requested](const ReadbackImage& image)
+			{
+				std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - requested;
+				fprintf(stdout, "Read back %dx%d window pixels in %.1f ms\n", image.width, image.height, elapsed.count());
+			});
+		}
+		else if (wParam == 'R')
+		{
+			renderer.toggle_recording();
+		}
+		else if (wParam == 'G')
+		{
+			renderer.export_poster("poster.png", posterEdge);
+		}
+		else if (wParam == 'X')
+		{
+			renderer.export_canvas("canvas.png");
+		}
+		else if (wParam == 'Q')
+		{
+			renderer.export_canvas("canvas.qoi");
+		}
+		else if (wParam == VK_DELETE)
+		{
+			POINT pt;
+			GetCursorPos(&pt);
+			ScreenToClient(windowHandle, &pt);
+			pt.x -= h_width;
+			pt.y -= h_height;
+			pt.y = -pt.y;
+			size_t id;
+			if (renderer.pick_line(pt.x, pt.y, id))
+				renderer.delete_line(id);
+		}
 	}
 
 	return DefWindowProc(windowHandle, messageID, wParam, lParam);
 }
 
-int main()
+int main(int argc, char** argv)
 {
+	// Canvas format, blend mode and document from the command line, rgba8 and over unless given
+	RendererSettings settings;
+	bool open_document = false;
+	const char* import_path = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "max") == 0)
+			settings.blend = BlendMode::Max;
+		else if (strcmp(argv[i], "rawsnap") == 0)
+			settings.compress_snapshots = false;
+		else if (strcmp(argv[i], "rawframes") == 0)
+			settings.raw_capture = true;
+		else if (strcmp(argv[i], "compact") == 0)
+			settings.compact_lines = true;
+		else if (strncmp(argv[i], "poster=", 7) == 0 && atoi(argv[i] + 7) > 0)
+			posterEdge = atoi(argv[i] + 7);
+		else if (hasExtension(argv[i], ".lines"))
+		{
+			documentPath = argv[i];
+			open_document = true;
+		}
+		else if (hasExtension(argv[i], ".csv") || hasExtension(argv[i], ".tsv") || hasExtension(argv[i], ".txt"))
+			import_path = argv[i];
+		else if (!Canvas::parse_format(argv[i], settings.format))
+			fprintf(stdout, "Unknown option %s, use rgba8, rgb10a2, rgba16f, r8, max, rawsnap, rawframes, compact, poster=N, a .lines document or a .csv/.tsv file\n", argv[i]);
+	}
+
 	// Create window
 	WNDCLASSEX windowClassEx;
 	windowClassEx.cbSize = sizeof(WNDCLASSEX);
@@ -101,17 +328,19 @@ int main()
 
 	// Compute window size
 	RECT windowRect = { 0, 0, width, height };
-	AdjustWindowRect(&windowRect, WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU, FALSE);
+	AdjustWindowRect(&windowRect, WS_OVERLAPPEDWINDOW, FALSE);
 
 	// Create window
 	HWND windowHandle = CreateWindow(
 		windowClassEx.lpszClassName,
 		"mainWindow",
-		WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU,
+		WS_OVERLAPPEDWINDOW,
 		0, 0,
 		windowRect.right - windowRect.left, windowRect.bottom - windowRect.top,
 		NULL, NULL, windowClassEx.hInstance, NULL
 	);
+	DragAcceptFiles(windowHandle, TRUE);
+	SetTimer(windowHandle, autosaveTimer, autosaveInterval, NULL);
 	ShowWindow(windowHandle, SW_SHOW);
 	UpdateWindow(windowHandle);
 
@@ -120,7 +349,7 @@ int main()
 	{
 		sizeof(PIXELFORMATDESCRIPTOR),
 		1,
-		PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER,    //Flags
+		PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER | PFD_SWAP_COPY,    //Flags
 		PFD_TYPE_RGBA,        // The kind of framebuffer. RGBA or palette.
 		32,                   // Colordepth of the framebuffer.
 		0, 0, 0, 0, 0, 0,
@@ -172,11 +401,61 @@ int main()
 		fprintf(stdout, "Unsupported OpenGL verion 2.0, please update your drivers");
 
 	// Graphics initialization
-	renderer.initialize(width, height);
+	renderer.initialize(width, height, settings);
+	renderDevice = render_device;
+	if (open_document)
+		renderer.open_document(documentPath);
+	else
+		renderer.start_session(documentPath);
+	if (import_path)
+		renderer.import_lines(import_path);
+
+	// Swap copy is only a hint, check whether the driver actually honours it
+	PIXELFORMATDESCRIPTOR chosen_format;
+	DescribePixelFormat(render_device, pixel_format, sizeof(PIXELFORMATDESCRIPTOR), &chosen_format);
+	renderer.set_back_buffer_preserved((chosen_format.dwFlags & PFD_SWAP_COPY) != 0);
+
+	// Pace frames with vsync when available, otherwise wait out the refresh interval ourselves
+	bool vsync = WGLEW_EXT_swap_control && wglSwapIntervalEXT(1);
+	int refresh_rate = GetDeviceCaps(render_device, VREFRESH);
+	if (refresh_rate <= 1)
+		refresh_rate = 60;
+	std::chrono::steady_clock::duration frame_interval = std::chrono::microseconds(1000000 / refresh_rate);
+	std::chrono::steady_clock::time_point next_frame = std::chrono::steady_clock::now();
 
 	// Main loop
 	while (windowAlive)
 	{
+		// Work spread over frames keeps the loop going until it's done
+		if (renderer.has_pending_work())
+			redraw = true;
+
+		// Nothing changed, sleep until the next message arrives
+		if (!redraw)
+			WaitMessage();
+		else if (!vsync)
+		{
+			// Keep pumping input while waiting for the next refresh so it lands in this frame
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			while (now < next_frame)
+			{
+				DWORD wait_ms = static_cast<DWORD>(std::chrono::duration_cast<std::chrono::milliseconds>(next_frame - now).count());
+				MsgWaitForMultipleObjectsEx(0, NULL, wait_ms, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+				MSG message;
+				while (PeekMessage(&message, windowHandle, 0, 0, PM_REMOVE))
+				{
+					TranslateMessage(&message);
+					DispatchMessage(&message);
+				}
+				now = std::chrono::steady_clock::now();
+			}
+		}
+
+		// Wait for a free frame slot before reading input, so it is as fresh as possible
+		bool frame_begun = redraw;
+		if (frame_begun)
+			renderer.begin_frame();
+
 		MSG message;
 		while (PeekMessage(&message, windowHandle, 0, 0, PM_REMOVE))
 		{
@@ -184,9 +463,19 @@ int main()
 			DispatchMessage(&message);
 		}
 
+		if (!redraw)
+			continue;
+		redraw = false;
+
+		// Woken up by the message we just handled
+		if (!frame_begun)
+			renderer.begin_frame();
+
 		renderer.render();
 
-		SwapBuffers(render_device);
+		SwapBuffers(renderDevice);
+		renderer.end_frame();
+		next_frame = std::chrono::steady_clock::now() + frame_interval;
 	}
 
 	// Graphics shutdown